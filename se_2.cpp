@@ -1,17 +1,163 @@
 // search_engine_full.cpp
-// Compile: g++ -std=c++17 search_engine_full.cpp -O2 -o search
+// Compile: g++ -std=c++17 search_engine_full.cpp -O2 -pthread -o search
 #include <bits/stdc++.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 using namespace std;
 
+// Query instrumentation (see Profiling); build with -DSEARCH_PROFILE=0 to compile it out
+#ifndef SEARCH_PROFILE
+#define SEARCH_PROFILE 1
+#endif
+
 // -------------------- Utilities --------------------
-string toLower(const string &s) {
-    string r = s;
-    transform(r.begin(), r.end(), r.begin(), ::tolower);
+// Tokens are maximal runs of ASCII letters and digits, lowercased; every other
+// byte (including UTF-8 bytes >= 0x80) separates them. The classify kernels
+// write the lowercased text and a bitmask of word bytes (bit i%64 of mask[i/64])
+// for n bytes; the SIMD ones handle 64-byte groups and leave the tail to the
+// scalar one.
+size_t classifyTail(const char *in, size_t n, char *out, uint64_t *mask, size_t from) {
+    for (size_t i = from; i < n; ++i) {
+        unsigned char c = in[i];
+        bool upper = (unsigned)(c - 'A') < 26;
+        bool word = upper || (unsigned)(c - 'a') < 26 || (unsigned)(c - '0') < 10;
+        out[i] = upper ? c | 0x20 : c;
+        if (i % 64 == 0) mask[i / 64] = 0;
+        mask[i / 64] |= (uint64_t)word << (i % 64);
+    }
+    return n;
+}
+
+size_t classifyScalar(const char *in, size_t n, char *out, uint64_t *mask) { return classifyTail(in, n, out, mask, 0); }
+
+#if defined(__x86_64__) || defined(__i386__)
+// bytes in [lo, hi]; bytes >= 0x80 compare as negative and never match
+static inline __m128i inRange16(__m128i c, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(lo - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8(hi + 1)));
+}
+
+size_t classifySse2(const char *in, size_t n, char *out, uint64_t *mask) {
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        uint64_t m = 0;
+        for (int k = 0; k < 64; k += 16) {
+            __m128i c = _mm_loadu_si128((const __m128i*)(in + i + k));
+            __m128i up = inRange16(c, 'A', 'Z');
+            __m128i word = _mm_or_si128(_mm_or_si128(up, inRange16(c, 'a', 'z')), inRange16(c, '0', '9'));
+            _mm_storeu_si128((__m128i*)(out + i + k), _mm_or_si128(c, _mm_and_si128(up, _mm_set1_epi8(0x20))));
+            m |= (uint64_t)(uint32_t)_mm_movemask_epi8(word) << k;
+        }
+        mask[i / 64] = m;
+    }
+    return classifyTail(in, n, out, mask, i);
+}
+
+__attribute__((target("avx2"))) static inline __m256i inRange32(__m256i c, char lo, char hi) {
+    return _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8(lo - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), c));
+}
+
+__attribute__((target("avx2"))) size_t classifyAvx2(const char *in, size_t n, char *out, uint64_t *mask) {
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        uint64_t m = 0;
+        for (int k = 0; k < 64; k += 32) {
+            __m256i c = _mm256_loadu_si256((const __m256i*)(in + i + k));
+            __m256i up = inRange32(c, 'A', 'Z');
+            __m256i word = _mm256_or_si256(_mm256_or_si256(up, inRange32(c, 'a', 'z')), inRange32(c, '0', '9'));
+            _mm256_storeu_si256((__m256i*)(out + i + k), _mm256_or_si256(c, _mm256_and_si256(up, _mm256_set1_epi8(0x20))));
+            m |= (uint64_t)(uint32_t)_mm256_movemask_epi8(word) << k;
+        }
+        mask[i / 64] = m;
+    }
+    return classifyTail(in, n, out, mask, i);
+}
+#endif
+
+typedef size_t (*ClassifyFn)(const char *in, size_t n, char *out, uint64_t *mask);
+
+// the widest kernel the CPU supports; TOKENIZER=scalar|sse2 forces a narrower one
+ClassifyFn pickClassify() {
+    const char *force = getenv("TOKENIZER");
+    string f = force ? force : "";
+#if defined(__x86_64__) || defined(__i386__)
+    if (f != "scalar" && f != "sse2" && __builtin_cpu_supports("avx2")) return classifyAvx2;
+    if (f != "scalar" && __builtin_cpu_supports("sse2")) return classifySse2;
+#endif
+    return classifyScalar;
+}
+
+const ClassifyFn classify = pickClassify();
+
+// Streaming tokenizer. Tokens are views into a lowercased copy of the text
+// held by the tokenizer; they stay valid until the next call, and the buffers
+// are reused so steady-state tokenizing does not allocate.
+class Tokenizer {
+private:
+    ClassifyFn kernel;
+    string lower;
+    vector<uint64_t> mask;
+    vector<string_view> tokens;
+
+    // first position >= from whose bit equals set, n if none
+    size_t next(size_t from, size_t n, bool set) const {
+        size_t w = from / 64;
+        if (w >= mask.size()) return n;
+        uint64_t bits = (set ? mask[w] : ~mask[w]) & (~0ull << (from % 64));
+        while (!bits) {
+            if (++w == mask.size()) return n;
+            bits = set ? mask[w] : ~mask[w];
+        }
+        return min(n, w * 64 + __builtin_ctzll(bits));
+    }
+
+public:
+    Tokenizer(ClassifyFn fn = classify) : kernel(fn) {}
+
+    const vector<string_view> &operator()(string_view text) {
+        size_t n = text.size();
+        lower.resize(n);
+        mask.assign((n + 63) / 64, 0);
+        kernel(text.data(), n, &lower[0], mask.data());
+        tokens.clear();
+        for (size_t start = next(0, n, true); start < n; ) {
+            size_t end = next(start, n, false);
+            tokens.push_back(string_view(lower.data() + start, end - start));
+            start = next(end, n, true);
+        }
+        return tokens;
+    }
+
+    // byte offset in its text of a token of the last call
+    size_t offsetOf(string_view token) const { return token.data() - lower.data(); }
+};
+
+string toLower(string_view s) {
+    string r(s.size(), '\0');
+    vector<uint64_t> mask((s.size() + 63) / 64);
+    classify(s.data(), s.size(), &r[0], mask.data());
     return r;
 }
 
-vector<string> tokenize(const string &text) {
-    // basic tokenization: split on non-alphanumeric, keep words and numbers
+vector<string> tokenize(string_view text) {
+    thread_local Tokenizer tok;
+    vector<string> tokens;
+    for (string_view t : tok(text)) tokens.emplace_back(t);
+    return tokens;
+}
+
+// The original per-char tokenizer, kept as the baseline for --bench-tokenizer
+vector<string> tokenizeSimple(const string &text) {
     vector<string> tokens;
     string token;
     for (char c : text) {
@@ -20,351 +166,5544 @@ vector<string> tokenize(const string &text) {
             if (!token.empty()) { tokens.push_back(token); token.clear(); }
         }
     }
-    if (!token.empty()) tokens.push_back(token);
-    return tokens;
-}
+    if (!token.empty()) tokens.push_back(token);
+    return tokens;
+}
+
+int levenshtein(string_view a, string_view b) {
+    int n = a.size(), m = b.size();
+    if (n == 0) return m;
+    if (m == 0) return n;
+    vector<int> prev(m+1), cur(m+1);
+    iota(prev.begin(), prev.end(), 0);
+    for (int i = 1; i <= n; ++i) {
+        cur[0] = i;
+        for (int j = 1; j <= m; ++j) {
+            int cost = (a[i-1]==b[j-1])?0:1;
+            cur[j] = min({ prev[j] + 1, cur[j-1] + 1, prev[j-1] + cost });
+        }
+        swap(prev, cur);
+    }
+    return prev[m];
+}
+
+// -------------------- Profiling --------------------
+// Per-query execution profile: exclusive time per stage plus work counters.
+// The hot paths update the profile of the query running on their thread
+// through QueryProfile::active, so nothing is threaded through the calls;
+// with no active profile an update is one thread-local load and a branch.
+struct QueryProfile {
+    enum Stage { PARSE, FUZZY, CANDIDATES, PHRASE, ACRONYM, MATCH, DENSE, SCORE, MERGE, STAGES };
+    static constexpr const char *stageNames[STAGES] = {"parse", "fuzzy", "candidates", "phrase", "acronym", "match", "dense", "score", "merge"};
+
+    uint64_t ns[STAGES] = {};
+    uint64_t totalNs = 0;
+    uint64_t candidates = 0;      // docs scored
+    uint64_t postings = 0;        // postings decoded
+    uint64_t positions = 0;       // token positions decoded
+    uint64_t bytes = 0;           // posting and position bytes decoded
+    uint64_t levenshtein = 0;     // edit distance DP rows computed
+    bool cached = false;          // answered from the result cache
+
+    static thread_local QueryProfile *active;
+
+    void add(const QueryProfile &o) {
+        for (int s = 0; s < STAGES; ++s) ns[s] += o.ns[s];
+        candidates += o.candidates;
+        postings += o.postings;
+        positions += o.positions;
+        bytes += o.bytes;
+        levenshtein += o.levenshtein;
+    }
+};
+thread_local QueryProfile *QueryProfile::active = nullptr;
+
+// makes a profile the active one of this thread for a scope
+class ProfileScope {
+private:
+    QueryProfile *prev;
+
+public:
+    explicit ProfileScope(QueryProfile *p) : prev(QueryProfile::active) { QueryProfile::active = p; }
+    ~ProfileScope() { QueryProfile::active = prev; }
+};
+
+// Times a stage for a scope. Stages nest; time spent in an inner stage is
+// taken out of the outer one, so the stages of a query add up to its total.
+class StageTimer {
+private:
+    QueryProfile *p;
+    QueryProfile::Stage stage;
+    chrono::steady_clock::time_point start;
+    uint64_t inner = 0;
+    StageTimer *outer;
+    static thread_local StageTimer *current;
+
+public:
+    explicit StageTimer(QueryProfile::Stage s) : p(QueryProfile::active), stage(s), outer(current) {
+        if (!p) return;
+        start = chrono::steady_clock::now();
+        current = this;
+    }
+
+    ~StageTimer() {
+        if (!p) return;
+        uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        p->ns[stage] += ns - min(ns, inner);
+        if (outer) outer->inner += ns;
+        current = outer;
+    }
+};
+thread_local StageTimer *StageTimer::current = nullptr;
+
+#if SEARCH_PROFILE
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_STAGE(s) StageTimer PROFILE_CONCAT(stageTimer_, __LINE__)(QueryProfile::s)
+#define PROFILE_COUNT(field, n) do { if (QueryProfile *p_ = QueryProfile::active) p_->field += (n); } while (0)
+#else
+#define PROFILE_STAGE(s) do {} while (0)
+#define PROFILE_COUNT(field, n) do { (void)sizeof(n); } while (0)
+#endif
+
+// Cumulative latency histogram with fixed buckets, safe to update from any thread
+class LatencyHistogram {
+public:
+    static constexpr double bounds[] = {25e-6, 50e-6, 100e-6, 250e-6, 500e-6, 1e-3, 2.5e-3, 5e-3, 10e-3, 25e-3, 50e-3, 100e-3, 250e-3, 1.0};
+    static constexpr int kBuckets = sizeof(bounds) / sizeof(bounds[0]);
+
+private:
+    atomic<uint64_t> counts[kBuckets + 1] = {}; // the last one is +Inf
+    atomic<uint64_t> sumNs{0};
+
+public:
+    void observe(uint64_t ns) {
+        int b = lower_bound(bounds, bounds + kBuckets, ns * 1e-9) - bounds;
+        counts[b].fetch_add(1, memory_order_relaxed);
+        sumNs.fetch_add(ns, memory_order_relaxed);
+    }
+
+    // the bucket, sum and count lines of a Prometheus histogram
+    void write(ostream &out, const string &name, const string &labels) const {
+        uint64_t cum = 0;
+        string sep = labels.empty() ? "" : ",";
+        for (int b = 0; b <= kBuckets; ++b) {
+            cum += counts[b].load(memory_order_relaxed);
+            out << name << "_bucket{" << labels << sep << "le=\"";
+            if (b < kBuckets) out << bounds[b];
+            else out << "+Inf";
+            out << "\"} " << cum << "\n";
+        }
+        string l = labels.empty() ? "" : "{" + labels + "}";
+        out << name << "_sum" << l << " " << sumNs.load(memory_order_relaxed) * 1e-9 << "\n";
+        out << name << "_count" << l << " " << cum << "\n";
+    }
+};
+
+// Aggregate of every profiled query, dumped in the Prometheus text format
+class QueryMetrics {
+private:
+    LatencyHistogram total;
+    LatencyHistogram stages[QueryProfile::STAGES];
+    atomic<uint64_t> queries{0}, cached{0}, candidates{0}, postings{0}, positions{0}, bytes{0}, levenshtein{0};
+
+public:
+    void observe(const QueryProfile &p) {
+        total.observe(p.totalNs);
+        queries.fetch_add(1, memory_order_relaxed);
+        if (p.cached) { cached.fetch_add(1, memory_order_relaxed); return; }
+        for (int s = 0; s < QueryProfile::STAGES; ++s) if (p.ns[s]) stages[s].observe(p.ns[s]);
+        candidates.fetch_add(p.candidates, memory_order_relaxed);
+        postings.fetch_add(p.postings, memory_order_relaxed);
+        positions.fetch_add(p.positions, memory_order_relaxed);
+        bytes.fetch_add(p.bytes, memory_order_relaxed);
+        levenshtein.fetch_add(p.levenshtein, memory_order_relaxed);
+    }
+
+    string prometheus() const {
+        ostringstream out;
+        out << "# HELP search_query_duration_seconds Query latency, cache hits included.\n"
+            << "# TYPE search_query_duration_seconds histogram\n";
+        total.write(out, "search_query_duration_seconds", "");
+        out << "# HELP search_stage_duration_seconds Time of a query in one stage (queries that reached it).\n"
+            << "# TYPE search_stage_duration_seconds histogram\n";
+        for (int s = 0; s < QueryProfile::STAGES; ++s) {
+            stages[s].write(out, "search_stage_duration_seconds", string("stage=\"") + QueryProfile::stageNames[s] + "\"");
+        }
+        auto counter = [&](const char *name, const char *help, const atomic<uint64_t> &v) {
+            out << "# HELP " << name << " " << help << "\n# TYPE " << name << " counter\n"
+                << name << " " << v.load(memory_order_relaxed) << "\n";
+        };
+        counter("search_queries_total", "Queries served.", queries);
+        counter("search_cached_queries_total", "Queries answered from the result cache.", cached);
+        counter("search_candidates_scored_total", "Documents scored.", candidates);
+        counter("search_postings_decoded_total", "Postings decoded.", postings);
+        counter("search_positions_decoded_total", "Token positions decoded.", positions);
+        counter("search_bytes_decoded_total", "Posting and position bytes decoded.", bytes);
+        counter("search_levenshtein_rows_total", "Edit distance rows computed by fuzzy expansion.", levenshtein);
+        return out.str();
+    }
+};
+
+// -------------------- Columns & segment files --------------------
+// Read-only slice of an array
+template <class T>
+struct Span {
+    const T *ptr = nullptr;
+    size_t n = 0;
+    Span() {}
+    Span(const T *p, size_t n) : ptr(p), n(n) {}
+    size_t size() const { return n; }
+    bool empty() const { return n == 0; }
+    const T *begin() const { return ptr; }
+    const T *end() const { return ptr + n; }
+    const T &operator[](size_t i) const { return ptr[i]; }
+};
+
+// Array that either owns its elements or views them inside a mapped segment
+// file. Reads go through a plain pointer in both cases. Copies share the
+// elements, so a snapshot of a structure made of columns is cheap; the first
+// write to a shared or mapped column copies it into fresh owned storage.
+template <class T>
+class Column {
+private:
+    shared_ptr<vector<T>> own;
+    shared_ptr<const void> keep; // keeps the mapping of a mapped column alive
+    const T *ptr = nullptr;
+    size_t n = 0;
+
+    void sync() { ptr = own->data(); n = own->size(); }
+    vector<T> &mut() {
+        if (!own || keep || own.use_count() > 1) {
+            own = make_shared<vector<T>>(ptr, ptr + n);
+            keep.reset();
+            sync();
+        }
+        return *own;
+    }
+
+public:
+    size_t size() const { return n; }
+    bool empty() const { return n == 0; }
+    const T *data() const { return ptr; }
+    const T *begin() const { return ptr; }
+    const T *end() const { return ptr + n; }
+    const T &operator[](size_t i) const { return ptr[i]; }
+    const T &back() const { return ptr[n - 1]; }
+    Span<T> span(size_t from, size_t to) const { return Span<T>(ptr + from, to - from); }
+    size_t byteSize() const { return n * sizeof(T); }
+
+    T &w(size_t i) { return mut()[i]; } // writable element, the size stays put
+    void push_back(const T &v) { mut().push_back(v); sync(); }
+    void append(const T *first, const T *last) { mut().insert(own->end(), first, last); sync(); }
+    void resize(size_t k) { mut().resize(k); sync(); }
+    void assign(size_t k, const T &v) { assign(vector<T>(k, v)); }
+    void assign(vector<T> &&v) { own = make_shared<vector<T>>(move(v)); keep.reset(); sync(); }
+    void clear() { assign(vector<T>()); }
+
+    void mapTo(shared_ptr<const void> file, const void *p, size_t bytes) {
+        own.reset();
+        keep = move(file);
+        ptr = (const T*)p;
+        n = bytes / sizeof(T);
+    }
+};
+
+uint64_t checksum64(const uint8_t *p, size_t n) {
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ n;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        h = (h ^ (w * 0xff51afd7ed558ccdull)) * 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 29;
+    }
+    for (; i < n; ++i) h = (h ^ p[i]) * 0x100000001b3ull;
+    return h ^ (h >> 32);
+}
+
+// Segment file: a header, a table of sections and the section payloads,
+// each 64-byte aligned so mapped arrays can be used in place. Every section
+// carries a checksum; the table has its own so open() stays O(1) unless a
+// full verification is asked for.
+const char kSegmentMagic[8] = {'S','E','G','I','D','X','\0','\1'};
+const uint32_t kSegmentVersion = 8;
+const uint32_t kEndianTag = 0x01020304;
+
+struct SegmentHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint32_t sections;
+    uint32_t reserved;
+    uint64_t tableChecksum;
+};
+
+struct SectionEntry {
+    uint32_t tag;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t checksum;
+};
+
+// section tags
+enum : uint32_t {
+    kSecMeta = 1,
+    kSecDictArena = 10, kSecDictOffsets, kSecDictTable, kSecDictFc, kSecDictBuckets, kSecDictSorted,
+    kSecPostings = 20, kSecPositions, kSecSkips, kSecBounds,
+    kSecTerms = 30, kSecLists, kSecIdf, kSecStopwords, kSecBoundIdf, kSecBoundNorms, kSecBoundLens, kSecBoundFieldNorms,
+    kSecDocIds = 40, kSecDocLen, kSecDocFieldOff, kSecDocFields,
+    kSecDocVecStart, kSecDocVecTerms, kSecDocVecFreq, kSecDocVecTf,
+    kSecDocTitleStart, kSecDocTitleTerms, kSecDocSeqStart, kSecDocSeq, kSecDocIdSlots,
+    kSecDocTitleLen, kSecDocOffStart, kSecDocOffsets,
+    kSecAcronymSuffixes = 60, kSecFieldTokens,
+    kSecDenseCentroids = 70, kSecDenseCentroidScale, kSecDenseListStart, kSecDenseOrds, kSecDenseCodes, kSecDenseScales,
+};
+
+class SegmentWriter {
+private:
+    struct Part { uint32_t tag; const void *data; size_t size; };
+    vector<Part> parts;
+    deque<string> owned; // copies of the sections given as raw bytes
+
+public:
+    // Raw bytes are copied, so a section can be built in a local until
+    // write(); columns are written from where they are and must outlive it.
+    void add(uint32_t tag, const void *data, size_t size) {
+        owned.emplace_back((const char*)data, size);
+        parts.push_back({tag, owned.back().data(), size});
+    }
+    template <class T> void add(uint32_t tag, const Column<T> &c) {
+        static_assert(is_trivially_copyable<T>::value, "sections hold plain data");
+        parts.push_back({tag, c.data(), c.byteSize()});
+    }
+
+    // written to a temp file and renamed, so readers never see a partial segment
+    bool write(const string &path, string &err) const {
+        SegmentHeader h;
+        memcpy(h.magic, kSegmentMagic, 8);
+        h.version = kSegmentVersion;
+        h.endian = kEndianTag;
+        h.sections = parts.size();
+        h.reserved = 0;
+        vector<SectionEntry> table;
+        uint64_t off = sizeof(SegmentHeader) + parts.size() * sizeof(SectionEntry);
+        for (auto &p : parts) {
+            off = (off + 63) & ~(uint64_t)63;
+            table.push_back({p.tag, 0, off, p.size, checksum64((const uint8_t*)p.data, p.size)});
+            off += p.size;
+        }
+        h.tableChecksum = checksum64((const uint8_t*)table.data(), table.size() * sizeof(SectionEntry));
+
+        string tmp = path + ".tmp";
+        ofstream out(tmp, ios::binary | ios::trunc);
+        if (!out) { err = "cannot write " + tmp; return false; }
+        out.write((const char*)&h, sizeof(h));
+        out.write((const char*)table.data(), table.size() * sizeof(SectionEntry));
+        uint64_t pos = sizeof(SegmentHeader) + table.size() * sizeof(SectionEntry);
+        static const char zeros[64] = {0};
+        for (size_t i = 0; i < parts.size(); ++i) {
+            out.write(zeros, table[i].offset - pos);
+            out.write((const char*)parts[i].data, parts[i].size);
+            pos = table[i].offset + parts[i].size;
+        }
+        out.close();
+        if (!out) { err = "short write to " + tmp; return false; }
+        if (rename(tmp.c_str(), path.c_str()) != 0) { err = "cannot rename " + tmp; return false; }
+        return true;
+    }
+};
+
+// Read-only mapping of a whole file
+class MappedFile {
+private:
+    void *base = MAP_FAILED;
+    size_t len = 0;
+
+public:
+    MappedFile() {}
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile() { if (base != MAP_FAILED) munmap(base, len); }
+
+    bool open(const string &path, string &err) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) { err = "cannot open " + path; return false; }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) { ::close(fd); err = "cannot stat " + path; return false; }
+        len = st.st_size;
+        base = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED) { err = "cannot map " + path; return false; }
+        return true;
+    }
+
+    const uint8_t *data() const { return (const uint8_t*)base; }
+    size_t size() const { return len; }
+};
+
+class SegmentReader {
+private:
+    shared_ptr<MappedFile> file;
+    const SectionEntry *table = nullptr;
+    uint32_t count = 0;
+
+public:
+    bool open(const string &path, bool verify, string &err) {
+        file = make_shared<MappedFile>();
+        if (!file->open(path, err)) return false;
+        const uint8_t *p = file->data();
+        size_t n = file->size();
+        if (n < sizeof(SegmentHeader)) { err = path + ": truncated header"; return false; }
+        const SegmentHeader *h = (const SegmentHeader*)p;
+        if (memcmp(h->magic, kSegmentMagic, 8) != 0) { err = path + ": not a segment file"; return false; }
+        if (h->version != kSegmentVersion) { err = path + ": unsupported version " + to_string(h->version); return false; }
+        if (h->endian != kEndianTag) { err = path + ": written with a different byte order"; return false; }
+        if (n < sizeof(SegmentHeader) + (uint64_t)h->sections * sizeof(SectionEntry)) { err = path + ": truncated section table"; return false; }
+        table = (const SectionEntry*)(p + sizeof(SegmentHeader));
+        count = h->sections;
+        if (checksum64((const uint8_t*)table, count * sizeof(SectionEntry)) != h->tableChecksum) { err = path + ": section table checksum mismatch"; return false; }
+        for (uint32_t i = 0; i < count; ++i) {
+            const SectionEntry &s = table[i];
+            if (s.offset % 64 || s.offset > n || s.size > n - s.offset) { err = path + ": section out of bounds"; return false; }
+            if (verify && checksum64(p + s.offset, s.size) != s.checksum) { err = path + ": checksum mismatch in section " + to_string(s.tag); return false; }
+        }
+        return true;
+    }
+
+    const SectionEntry *find(uint32_t tag) const {
+        for (uint32_t i = 0; i < count; ++i) if (table[i].tag == tag) return &table[i];
+        return nullptr;
+    }
+
+    template <class T>
+    bool map(uint32_t tag, Column<T> &c, string &err) const {
+        const SectionEntry *s = find(tag);
+        if (!s || s->size % sizeof(T)) { err = "missing or malformed section " + to_string(tag); return false; }
+        c.mapTo(file, file->data() + s->offset, s->size);
+        return true;
+    }
+};
+
+// -------------------- Posting lists --------------------
+// Postings of a term are kept docID-sorted in blocks of up to kBlockSize
+// entries. Inside a block the doc gaps are varint coded and the freqs are
+// bit-packed PFor-style: the bit width is picked to cover ~90% of the block
+// and the few larger values are patched from a small exception list. The
+// postings with title occurrences follow as (index, title freq) pairs, so
+// BM25F sees both field frequencies without touching the doc table.
+// Every block has a skip entry so cursors can jump whole blocks. Token
+// positions go to a separate stream (per posting: delta varints) that is
+// only decoded for phrase matching.
+const int kBlockSize = 128;
+
+template <class Out>
+void putVarint(Out &out, uint32_t v) {
+    while (v >= 0x80) { out.push_back((uint8_t)(v | 0x80)); v >>= 7; }
+    out.push_back((uint8_t)v);
+}
+
+uint32_t getVarint(const uint8_t *&p) {
+    uint32_t v = 0;
+    int shift = 0;
+    while (*p & 0x80) { v |= (uint32_t)(*p++ & 0x7f) << shift; shift += 7; }
+    v |= (uint32_t)(*p++) << shift;
+    return v;
+}
+
+int bitWidth(uint32_t v) {
+    int b = 0;
+    while (v) { b++; v >>= 1; }
+    return b;
+}
+
+struct SkipEntry {
+    uint32_t lastDoc;   // largest docID in the block
+    uint32_t offset;    // byte offset of the block in PostingIndex
+    uint32_t posOffset; // byte offset of the block's positions
+};
+
+// Score upper bounds of a block (or a whole list), split into the
+// query-independent factors so a query can weight them at search time.
+struct BlockBound {
+    float tfLen = 0;     // max (1 + log tf) * lenFactor
+    float tfLenNorm = 0; // max (1 + log tf) * lenFactor / docNorm
+    float len = 0;       // max lenFactor
+    float bm25 = 0;      // max saturated BM25F term frequency, see Bm25fScorer
+};
+
+struct PostingList {
+    uint32_t firstBlock = 0; // index of the first SkipEntry
+    uint32_t numBlocks = 0;
+    uint32_t df = 0;         // number of postings
+    bool hasPositions = false;
+    BlockBound maxBound;     // max over all blocks
+    uint32_t blockSize(uint32_t b) const {
+        return b + 1 < numBlocks ? kBlockSize : df - (numBlocks - 1) * kBlockSize;
+    }
+};
+
+class PostingIndex {
+private:
+    Column<uint8_t> bytes;
+    Column<uint8_t> posBytes;
+    Column<SkipEntry> skips;
+    Column<BlockBound> bounds; // parallel to skips
+
+    void encodeBlock(const pair<int,int> *p, const uint32_t *titleFreqs, int n, uint32_t prevDoc) {
+        for (int i = 0; i < n; ++i) {
+            putVarint(bytes, (uint32_t)p[i].first - prevDoc);
+            prevDoc = p[i].first;
+        }
+        // freqs are >= 1, store f-1
+        uint32_t vals[kBlockSize], sorted[kBlockSize];
+        for (int i = 0; i < n; ++i) vals[i] = sorted[i] = (uint32_t)p[i].second - 1;
+        nth_element(sorted, sorted + n * 9 / 10, sorted + n);
+        int b = bitWidth(sorted[n * 9 / 10]);
+        vector<pair<int,uint32_t>> exceptions;
+        for (int i = 0; i < n; ++i) {
+            if (b < 32 && (vals[i] >> b)) exceptions.push_back({i, vals[i] >> b});
+        }
+        bytes.push_back((uint8_t)b);
+        bytes.push_back((uint8_t)exceptions.size());
+        size_t start = bytes.size();
+        bytes.resize(start + (n * b + 7) / 8);
+        for (int i = 0, bit = 0; i < n; ++i, bit += b) {
+            for (int k = 0; k < b; ++k) {
+                if ((vals[i] >> k) & 1) bytes.w(start + (bit + k) / 8) |= (uint8_t)(1 << ((bit + k) % 8));
+            }
+        }
+        for (auto &e : exceptions) {
+            bytes.push_back((uint8_t)e.first);
+            putVarint(bytes, e.second);
+        }
+        int inTitle = 0;
+        for (int i = 0; i < n; ++i) inTitle += titleFreqs[i] > 0;
+        bytes.push_back((uint8_t)inTitle);
+        for (int i = 0; i < n; ++i) {
+            if (!titleFreqs[i]) continue;
+            bytes.push_back((uint8_t)i);
+            putVarint(bytes, titleFreqs[i]);
+        }
+    }
+
+public:
+    void clear() { bytes.clear(); posBytes.clear(); skips.clear(); bounds.clear(); }
+
+    // move all lists of other to the end of this index; returns the block
+    // shift to add to the firstBlock of other's PostingLists
+    uint32_t append(const PostingIndex &other) {
+        uint32_t shift = skips.size();
+        for (SkipEntry s : other.skips) {
+            s.offset += bytes.size();
+            s.posOffset += posBytes.size();
+            skips.push_back(s);
+        }
+        bytes.append(other.bytes.begin(), other.bytes.end());
+        posBytes.append(other.posBytes.begin(), other.posBytes.end());
+        bounds.append(other.bounds.begin(), other.bounds.end());
+        return shift;
+    }
+
+    // postings must be sorted by docID, freqs >= 1. positions, if given, holds
+    // freq increasing positions per posting, concatenated in posting order;
+    // titleLens (doc -> title tokens, the first tokens of a doc) then splits
+    // each freq into its title and body occurrences.
+    PostingList add(const vector<pair<int,int>> &postings, const vector<uint32_t> *positions = nullptr,
+                    const uint32_t *titleLens = nullptr) {
+        PostingList pl;
+        pl.firstBlock = skips.size();
+        pl.df = postings.size();
+        pl.hasPositions = positions != nullptr;
+        uint32_t prevDoc = 0;
+        size_t pos = 0;
+        for (size_t i = 0; i < postings.size(); i += kBlockSize) {
+            int n = (int)min(postings.size() - i, (size_t)kBlockSize);
+            SkipEntry s;
+            s.offset = bytes.size();
+            s.posOffset = posBytes.size();
+            s.lastDoc = postings[i + n - 1].first;
+            skips.push_back(s);
+            uint32_t titleFreqs[kBlockSize] = {};
+            if (positions && titleLens) {
+                const uint32_t *p = positions->data() + pos;
+                for (int k = 0; k < n; p += postings[i + k].second, ++k) {
+                    titleFreqs[k] = lower_bound(p, p + postings[i + k].second, titleLens[postings[i + k].first]) - p;
+                }
+            }
+            encodeBlock(&postings[i], titleFreqs, n, prevDoc);
+            prevDoc = s.lastDoc;
+            if (!positions) continue;
+            for (int k = 0; k < n; ++k) {
+                uint32_t prev = 0;
+                for (int f = 0; f < postings[i + k].second; ++f, ++pos) {
+                    putVarint(posBytes, (*positions)[pos] - prev);
+                    prev = (*positions)[pos];
+                }
+            }
+        }
+        pl.numBlocks = skips.size() - pl.firstBlock;
+        bounds.resize(skips.size());
+        return pl;
+    }
+
+    // give the block bounds a private zeroed buffer, so that computeBounds()
+    // can fill lists from several threads while older copies keep theirs
+    void resetBounds() { bounds.assign(vector<BlockBound>(skips.size())); }
+
+    // fill the block bounds of a list; fn(doc, freq, titleFreq, bound) raises bound for one posting
+    template <class Fn>
+    void computeBounds(PostingList &pl, Fn fn) {
+        uint32_t docs[kBlockSize], freqs[kBlockSize], titleFreqs[kBlockSize];
+        pl.maxBound = BlockBound();
+        for (uint32_t b = 0; b < pl.numBlocks; ++b) {
+            BlockBound &bb = bounds.w(pl.firstBlock + b);
+            bb = BlockBound();
+            int n = decodeBlock(pl, b, docs, freqs, titleFreqs);
+            for (int i = 0; i < n; ++i) fn(docs[i], freqs[i], titleFreqs[i], bb);
+            pl.maxBound.tfLen = max(pl.maxBound.tfLen, bb.tfLen);
+            pl.maxBound.tfLenNorm = max(pl.maxBound.tfLenNorm, bb.tfLenNorm);
+            pl.maxBound.len = max(pl.maxBound.len, bb.len);
+            pl.maxBound.bm25 = max(pl.maxBound.bm25, bb.bm25);
+        }
+    }
+
+    const SkipEntry &skip(const PostingList &pl, uint32_t b) const { return skips[pl.firstBlock + b]; }
+    const BlockBound &bound(const PostingList &pl, uint32_t b) const { return bounds[pl.firstBlock + b]; }
+
+    // decode block b of a list into docs/freqs and, if given, the title part
+    // of each freq; returns the entry count
+    int decodeBlock(const PostingList &pl, uint32_t b, uint32_t *docs, uint32_t *freqs,
+                    uint32_t *titleFreqs = nullptr) const {
+        int n = pl.blockSize(b);
+        const uint8_t *p = bytes.data() + skips[pl.firstBlock + b].offset, *start = p;
+        uint32_t doc = b ? skips[pl.firstBlock + b - 1].lastDoc : 0;
+        for (int i = 0; i < n; ++i) { doc += getVarint(p); docs[i] = doc; }
+        int w = *p++;
+        int nExc = *p++;
+        uint64_t buf = 0;
+        int have = 0;
+        uint32_t mask = w == 32 ? 0xffffffffu : (1u << w) - 1;
+        for (int i = 0; i < n; ++i) {
+            while (have < w) { buf |= (uint64_t)(*p++) << have; have += 8; }
+            freqs[i] = (uint32_t)buf & mask;
+            buf >>= w;
+            have -= w;
+        }
+        for (int e = 0; e < nExc; ++e) {
+            int i = *p++;
+            freqs[i] |= getVarint(p) << w;
+        }
+        for (int i = 0; i < n; ++i) freqs[i] += 1;
+        if (titleFreqs) {
+            fill(titleFreqs, titleFreqs + n, 0);
+            for (int e = *p++; e > 0; --e) {
+                int i = *p++;
+                titleFreqs[i] = getVarint(p);
+            }
+        }
+        PROFILE_COUNT(postings, n);
+        PROFILE_COUNT(bytes, p - start);
+        return n;
+    }
+
+    // positions of every posting in block b; starts[i] indexes posting i in out
+    void decodePositions(const PostingList &pl, uint32_t b, const uint32_t *freqs, int n,
+                         vector<uint32_t> &out, uint32_t *starts) const {
+        out.clear();
+        const uint8_t *p = posBytes.data() + skips[pl.firstBlock + b].posOffset, *start = p;
+        for (int i = 0; i < n; ++i) {
+            starts[i] = out.size();
+            uint32_t v = 0;
+            for (uint32_t f = 0; f < freqs[i]; ++f) { v += getVarint(p); out.push_back(v); }
+        }
+        starts[n] = out.size();
+        PROFILE_COUNT(positions, out.size());
+        PROFILE_COUNT(bytes, p - start);
+    }
+
+    // First block at or after from whose last doc is >= target. Gallops
+    // from `from` before the binary search, so a cursor moving forward pays
+    // for the distance it skips rather than for the length of the list.
+    uint32_t findBlock(const PostingList &pl, uint32_t target, uint32_t from = 0) const {
+        const SkipEntry *first = skips.begin() + pl.firstBlock;
+        uint32_t lo = from, hi = from, step = 1;
+        while (hi < pl.numBlocks && first[hi].lastDoc < target) {
+            lo = hi + 1;
+            hi += step;
+            step *= 2;
+        }
+        auto it = lower_bound(first + lo, first + min(hi, pl.numBlocks), target,
+                              [](const SkipEntry &s, uint32_t t){ return s.lastDoc < t; });
+        return it - first;
+    }
+
+    // freq of doc in the list, 0 if absent
+    int freqOf(const PostingList &pl, uint32_t doc) const {
+        uint32_t b = findBlock(pl, doc);
+        if (b >= pl.numBlocks) return 0;
+        uint32_t docs[kBlockSize], freqs[kBlockSize];
+        int n = decodeBlock(pl, b, docs, freqs);
+        int i = lower_bound(docs, docs + n, doc) - docs;
+        return (i < n && docs[i] == doc) ? (int)freqs[i] : 0;
+    }
+
+    size_t byteSize() const { return bytes.size() + skips.byteSize() + bounds.byteSize(); }
+    size_t positionBytes() const { return posBytes.size(); }
+
+    void save(SegmentWriter &w) const {
+        w.add(kSecPostings, bytes);
+        w.add(kSecPositions, posBytes);
+        w.add(kSecSkips, skips);
+        w.add(kSecBounds, bounds);
+    }
+
+    bool map(const SegmentReader &r, string &err) {
+        return r.map(kSecPostings, bytes, err) && r.map(kSecPositions, posBytes, err) &&
+               r.map(kSecSkips, skips, err) && r.map(kSecBounds, bounds, err);
+    }
+};
+
+// Forward iterator over one posting list, decoding a block at a time.
+class PostingCursor {
+private:
+    const PostingIndex *ix;
+    PostingList pl;
+    uint32_t block = 0;
+    int pos = 0, count = 0;
+    uint32_t docBuf[kBlockSize], freqBuf[kBlockSize], titleBuf[kBlockSize];
+    bool posLoaded = false; // positions of the current block are decoded lazily
+    vector<uint32_t> posBuf;
+    uint32_t posStart[kBlockSize + 1];
+
+    void load(uint32_t b) {
+        block = b;
+        pos = 0;
+        posLoaded = false;
+        count = b < pl.numBlocks ? ix->decodeBlock(pl, b, docBuf, freqBuf, titleBuf) : 0;
+    }
+
+public:
+    static constexpr uint32_t END = UINT32_MAX;
+
+    PostingCursor() : ix(nullptr) {} // done until reset
+    PostingCursor(const PostingIndex &index, const PostingList &list) : ix(&index), pl(list) { load(0); }
+
+    // start over on another list, keeping the position buffer
+    void reset(const PostingIndex &index, const PostingList &list) {
+        ix = &index;
+        pl = list;
+        load(0);
+    }
+
+    bool done() const { return pos >= count; }
+    uint32_t doc() const { return done() ? END : docBuf[pos]; }
+    uint32_t freq() const { return freqBuf[pos]; }
+    uint32_t titleFreq() const { return titleBuf[pos]; } // occurrences of freq() in the title
+
+    void next() {
+        if (++pos >= count && block + 1 < pl.numBlocks) load(block + 1);
+    }
+
+    // move to the first posting with doc >= target, skipping whole blocks
+    void advance(uint32_t target) {
+        if (done() || docBuf[pos] >= target) return;
+        if (docBuf[count - 1] < target) {
+            uint32_t b = ix->findBlock(pl, target, block + 1);
+            if (b >= pl.numBlocks) { pos = count; return; }
+            load(b);
+        }
+        while (docBuf[pos] < target) pos++;
+    }
+
+    // positions of the current posting (the list must have been added with positions)
+    const uint32_t *positions(uint32_t &n) {
+        if (!posLoaded) {
+            ix->decodePositions(pl, block, freqBuf, count, posBuf, posStart);
+            posLoaded = true;
+        }
+        n = posStart[pos + 1] - posStart[pos];
+        return posBuf.data() + posStart[pos];
+    }
+
+    // shallow move for block-max pruning: the block that would hold target,
+    // found through the skip data without decoding anything
+    uint32_t blockFor(uint32_t target) const { return ix->findBlock(pl, target, block); }
+    uint32_t numBlocks() const { return pl.numBlocks; }
+    uint32_t blockLastDoc(uint32_t b) const { return ix->skip(pl, b).lastDoc; }
+    const BlockBound &blockBound(uint32_t b) const { return ix->bound(pl, b); }
+    const PostingList &list() const { return pl; }
+};
+
+// Bounded heap of the best K (docId, score) pairs. The worst kept entry is
+// at the front, so it doubles as the pruning threshold.
+class TopK {
+private:
+    int k;
+    vector<pair<int,double>> heap;
+
+public:
+    static bool better(const pair<int,double> &a, const pair<int,double> &b) {
+        if (fabs(a.second - b.second) > 1e-9) return a.second > b.second;
+        return a.first < b.first;
+    }
+
+    explicit TopK(int k) : k(k) {}
+
+    bool full() const { return k <= 0 || (int)heap.size() >= k; }
+    double threshold() const { return heap.empty() ? -HUGE_VAL : heap.front().second; }
+
+    void push(int id, double score) {
+        if (k <= 0) return;
+        pair<int,double> e(id, score);
+        if ((int)heap.size() < k) {
+            heap.push_back(e);
+            push_heap(heap.begin(), heap.end(), better);
+        } else if (better(e, heap.front())) {
+            pop_heap(heap.begin(), heap.end(), better);
+            heap.back() = e;
+            push_heap(heap.begin(), heap.end(), better);
+        }
+    }
+
+    vector<pair<int,double>> sorted() const {
+        vector<pair<int,double>> r = heap;
+        sort(r.begin(), r.end(), better);
+        return r;
+    }
+};
+
+// -------------------- Term dictionary --------------------
+// Maps every distinct term to a dense id, assigned in first-seen order so
+// ids stay stable as documents are added. Term bytes live in one arena and
+// exact lookups go through an open-addressing table of ids. freeze() builds
+// a sorted, front-coded copy for prefix and range scans: terms are grouped
+// in buckets of kFcBucket, the first stored in full and the others as
+// (shared prefix length, suffix).
+const int kFcBucket = 16;
+
+class TermDict {
+private:
+    Column<char> arena;
+    Column<uint32_t> offsets;   // term id -> start in arena, plus an end sentinel
+    Column<uint32_t> table;     // hash slots holding term ids
+    Column<uint8_t> fc;         // front-coded sorted terms
+    Column<uint32_t> fcBuckets; // byte offset of each bucket in fc
+    Column<uint32_t> sortedIds; // rank -> term id
+
+    static uint64_t hashOf(string_view s) {
+        uint64_t h = 1469598103934665603ull; // FNV-1a
+        for (unsigned char c : s) { h ^= c; h *= 1099511628211ull; }
+        return h;
+    }
+
+    void insertSlot(uint32_t id) {
+        size_t mask = table.size() - 1;
+        size_t i = hashOf(term(id)) & mask;
+        while (table[i] != NONE) i = (i + 1) & mask;
+        table.w(i) = id;
+    }
+
+    void grow() {
+        table.assign(max<size_t>(16, table.size() * 2), NONE);
+        for (uint32_t id = 0; id < size(); ++id) insertSlot(id);
+    }
+
+public:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    TermDict() { offsets.push_back(0); }
+
+    uint32_t size() const { return offsets.size() - 1; }
+
+    string_view term(uint32_t id) const {
+        return string_view(arena.data() + offsets[id], offsets[id+1] - offsets[id]);
+    }
+
+    uint32_t find(string_view t) const {
+        if (table.empty()) return NONE;
+        size_t mask = table.size() - 1;
+        for (size_t i = hashOf(t) & mask; table[i] != NONE; i = (i + 1) & mask) {
+            if (term(table[i]) == t) return table[i];
+        }
+        return NONE;
+    }
+
+    uint32_t intern(string_view t) {
+        uint32_t id = find(t);
+        if (id != NONE) return id;
+        id = size();
+        arena.append(t.data(), t.data() + t.size());
+        offsets.push_back(arena.size());
+        if ((size_t)size() * 2 > table.size()) grow();
+        else insertSlot(id);
+        return id;
+    }
+
+    // rebuild the sorted front-coded view over all terms
+    void freeze() {
+        vector<uint32_t> ids(size());
+        iota(ids.begin(), ids.end(), 0);
+        sort(ids.begin(), ids.end(), [&](uint32_t a, uint32_t b) { return term(a) < term(b); });
+        vector<uint8_t> codes;
+        vector<uint32_t> heads;
+        string_view prev;
+        for (size_t r = 0; r < ids.size(); ++r) {
+            string_view t = term(ids[r]);
+            if (r % kFcBucket == 0) {
+                heads.push_back(codes.size());
+                putVarint(codes, t.size());
+                codes.insert(codes.end(), t.begin(), t.end());
+            } else {
+                size_t shared = 0;
+                while (shared < prev.size() && shared < t.size() && prev[shared] == t[shared]) shared++;
+                putVarint(codes, shared);
+                putVarint(codes, t.size() - shared);
+                codes.insert(codes.end(), t.begin() + shared, t.end());
+            }
+            prev = t;
+        }
+        sortedIds.assign(move(ids));
+        fc.assign(move(codes));
+        fcBuckets.assign(move(heads));
+    }
+
+    // Cursor over the sorted terms. shared() is the length of the prefix the
+    // current term has in common with the previously visited one (0 after a seek).
+    class Iter {
+    private:
+        const TermDict *d;
+        size_t rank = 0;
+        const uint8_t *p = nullptr;
+        string cur;
+        size_t sharedLen = 0;
+
+        void decode() {
+            if (rank >= d->sortedIds.size()) return;
+            if (rank % kFcBucket == 0) {
+                p = d->fc.data() + d->fcBuckets[rank / kFcBucket];
+                uint32_t len = getVarint(p);
+                string_view t((const char*)p, len);
+                sharedLen = 0;
+                while (sharedLen < cur.size() && sharedLen < t.size() && cur[sharedLen] == t[sharedLen]) sharedLen++;
+                cur.assign(t);
+                p += len;
+            } else {
+                sharedLen = getVarint(p);
+                uint32_t len = getVarint(p);
+                cur.resize(sharedLen);
+                cur.append((const char*)p, len);
+                p += len;
+            }
+        }
+
+    public:
+        explicit Iter(const TermDict &dict) : d(&dict) { decode(); }
+
+        bool valid() const { return rank < d->sortedIds.size(); }
+        string_view term() const { return cur; }
+        uint32_t id() const { return d->sortedIds[rank]; }
+        size_t shared() const { return sharedLen; }
+        void next() { rank++; decode(); }
+
+        // position on the first term >= target
+        void seek(string_view target) {
+            size_t lo = 0, hi = d->fcBuckets.size();
+            while (hi - lo > 1) { // last bucket whose head is <= target
+                size_t mid = (lo + hi) / 2;
+                const uint8_t *q = d->fc.data() + d->fcBuckets[mid];
+                uint32_t len = getVarint(q);
+                if (string_view((const char*)q, len) <= target) lo = mid; else hi = mid;
+            }
+            cur.clear();
+            rank = lo * kFcBucket;
+            decode();
+            while (valid() && term() < target) next();
+            sharedLen = 0;
+        }
+    };
+
+    Iter begin() const { return Iter(*this); }
+
+    // ids of all terms in [lo, hi)
+    template <class Fn>
+    void forRange(string_view lo, string_view hi, Fn fn) const {
+        Iter it(*this);
+        for (it.seek(lo); it.valid() && it.term() < hi; it.next()) fn(it.id(), it.term());
+    }
+
+    // ids of all terms starting with prefix
+    template <class Fn>
+    void forPrefix(string_view prefix, Fn fn) const {
+        Iter it(*this);
+        for (it.seek(prefix); it.valid() && it.term().substr(0, prefix.size()) == prefix; it.next()) fn(it.id(), it.term());
+    }
+
+    size_t byteSize() const {
+        return arena.size() + fc.size() + offsets.byteSize() + table.byteSize() + fcBuckets.byteSize() + sortedIds.byteSize();
+    }
+
+    void save(SegmentWriter &w) const {
+        w.add(kSecDictArena, arena);
+        w.add(kSecDictOffsets, offsets);
+        w.add(kSecDictTable, table);
+        w.add(kSecDictFc, fc);
+        w.add(kSecDictBuckets, fcBuckets);
+        w.add(kSecDictSorted, sortedIds);
+    }
+
+    bool map(const SegmentReader &r, string &err) {
+        return r.map(kSecDictArena, arena, err) && r.map(kSecDictOffsets, offsets, err) &&
+               r.map(kSecDictTable, table, err) && r.map(kSecDictFc, fc, err) &&
+               r.map(kSecDictBuckets, fcBuckets, err) && r.map(kSecDictSorted, sortedIds, err);
+    }
+};
+
+// -------------------- Fuzzy term matching --------------------
+// Levenshtein automaton run against the sorted dictionary. Walking the terms
+// in order, the DP rows of the prefix shared with the previous term are
+// reused, and as soon as every cell of a row exceeds k no term with that
+// prefix can match, so the iterator seeks straight past the whole prefix.
+// Returns (term id, distance) for every term within distance k of q.
+vector<pair<uint32_t,int>> fuzzyTerms(const TermDict &dict, string_view q, int k) {
+    vector<pair<uint32_t,int>> out;
+    size_t m = q.size();
+    vector<int> rows(m + 1);
+    iota(rows.begin(), rows.end(), 0);
+    size_t depth = 0;  // rows are valid for the first depth chars of the previous term
+    uint64_t rowsComputed = 0;
+    string seekPrefix; // after a seek: the part of the skipped prefix kept by later terms
+    bool sought = false;
+    TermDict::Iter it = dict.begin();
+    while (it.valid()) {
+        string_view t = it.term();
+        size_t s = it.shared();
+        if (sought) {
+            s = 0;
+            while (s < seekPrefix.size() && s < t.size() && seekPrefix[s] == t[s]) s++;
+            sought = false;
+        }
+        size_t j = min(s, depth);
+        if (rows.size() < (t.size() + 1) * (m + 1)) rows.resize((t.size() + 1) * (m + 1));
+        bool dead = false;
+        while (j < t.size() && !dead) {
+            ++j;
+            rowsComputed++;
+            int *row = &rows[j * (m + 1)], *up = row - (m + 1);
+            row[0] = (int)j;
+            int best = row[0];
+            for (size_t i = 1; i <= m; ++i) {
+                row[i] = min({ up[i] + 1, row[i-1] + 1, up[i-1] + (q[i-1] != t[j-1] ? 1 : 0) });
+                best = min(best, row[i]);
+            }
+            dead = best > k;
+        }
+        depth = j;
+        if (dead) {
+            // skip every term starting with t[0..j). The next live prefix is usually
+            // close by, so step (shared() >= j means still inside) before seeking.
+            int steps = 0;
+            do { it.next(); } while (it.valid() && it.shared() >= j && ++steps < 2 * kFcBucket);
+            if (!it.valid() || it.shared() < j) continue;
+            string succ(it.term().substr(0, j));
+            while (!succ.empty() && (unsigned char)succ.back() == 0xff) succ.pop_back();
+            if (succ.empty()) break;
+            succ.back() = (char)((unsigned char)succ.back() + 1);
+            seekPrefix.assign(succ, 0, succ.size() - 1);
+            sought = true;
+            it.seek(succ);
+            continue;
+        }
+        int dist = rows[t.size() * (m + 1) + m];
+        if (dist <= k) out.push_back({it.id(), dist});
+        it.next();
+    }
+    PROFILE_COUNT(levenshtein, rowsComputed);
+    return out;
+}
+
+// -------------------- Thread pool --------------------
+// Fixed set of workers pulling tasks from a shared queue. parallelFor lets
+// the calling thread take part, so it also works from inside a task.
+class ThreadPool {
+private:
+    vector<thread> workers;
+    deque<function<void()>> tasks;
+    mutex mu;
+    condition_variable cv;
+    bool stopping = false;
+
+    void run() {
+        while (true) {
+            function<void()> task;
+            {
+                unique_lock<mutex> lock(mu);
+                cv.wait(lock, [&]{ return stopping || !tasks.empty(); });
+                if (tasks.empty()) return;
+                task = move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+public:
+    explicit ThreadPool(int n) {
+        for (int i = 0; i < n; ++i) workers.emplace_back([this]{ run(); });
+    }
+
+    ~ThreadPool() {
+        { lock_guard<mutex> lock(mu); stopping = true; }
+        cv.notify_all();
+        for (auto &w : workers) w.join();
+    }
+
+    int size() const { return workers.size(); }
+
+    void submit(function<void()> task) {
+        { lock_guard<mutex> lock(mu); tasks.push_back(move(task)); }
+        cv.notify_one();
+    }
+
+    // run fn(i) for every i in [0, n) and wait for all of them
+    void parallelFor(int n, const function<void(int)> &fn) {
+        if (n <= 0) return;
+        if (n == 1 || workers.empty()) { for (int i = 0; i < n; ++i) fn(i); return; }
+        struct State {
+            atomic<int> next{0}, done{0};
+            int n;
+            const function<void(int)> *fn;
+            mutex mu;
+            condition_variable cv;
+        };
+        auto st = make_shared<State>();
+        st->n = n;
+        st->fn = &fn;
+        auto work = [st]{
+            int i;
+            while ((i = st->next++) < st->n) {
+                (*st->fn)(i);
+                if (++st->done == st->n) { lock_guard<mutex> lock(st->mu); st->cv.notify_all(); }
+            }
+        };
+        for (int h = 0; h < min(n - 1, size()); ++h) submit(work);
+        work();
+        unique_lock<mutex> lock(st->mu);
+        st->cv.wait(lock, [&]{ return st->done == st->n; });
+    }
+};
+
+// -------------------- Document & DB --------------------
+// Every kOffsetStride-th body token has its byte offset in the content
+// stored, so the text around any position is found by tokenizing from the
+// checkpoint before it rather than from the start of the document.
+const uint32_t kOffsetStride = 16;
+
+// A document as added, filled in by analysis before it moves to the DocTable
+struct DocRecord {
+    int id;
+    string title;
+    string content;
+    string link;
+    vector<uint32_t> seq;         // term id of every token of title+content, in order (positions)
+    uint32_t titleLen = 0;        // the first titleLen tokens of seq are the title
+    vector<uint32_t> offsets;     // content byte offset of body tokens 0, kOffsetStride, 2 * kOffsetStride...
+    string acronym;              // shortform created from title words
+    vector<uint32_t> titleTerms;  // term ids of the title, sorted, unique
+    double lenFactor = 1.0;       // length normalization applied to the score
+    // term frequencies and tf-idf vector as parallel arrays sorted by term id
+    // (stopwords excluded); the idf part is applied through the query weights,
+    // so only the norm depends on corpus stats
+    vector<uint32_t> vecTerms;
+    vector<uint32_t> vecFreq;     // tf
+    vector<float> vecTf;          // 1 + log(tf)
+};
+
+// Read-only view of a stored document, see DocRecord for the fields
+struct Doc {
+    int id = 0;
+    string_view title;
+    string_view content;
+    string_view link;
+    Span<uint32_t> seq;
+    uint32_t titleLen = 0;
+    Span<uint32_t> offsets;
+    string_view acronym;
+    Span<uint32_t> titleTerms;
+    double lenFactor = 1.0;
+    Span<uint32_t> vecTerms;
+    Span<uint32_t> vecFreq;
+    Span<float> vecTf;
+    shared_ptr<const void> keep;  // set by getDocById: keeps the segment alive
+};
+
+// Excerpt of a doc's content chosen for a query, see IndexSnapshot::snippets
+struct Snippet {
+    string text;                            // "..." marks where the content was cut
+    vector<pair<uint32_t,uint32_t>> marks;  // offset and length in text of each matched term
+
+    string render(const char *open, const char *close) const {
+        string out;
+        size_t at = 0;
+        for (auto &m : marks) {
+            out.append(text, at, m.first - at);
+            out += open;
+            out.append(text, m.first, m.second);
+            out += close;
+            at = m.first + m.second;
+        }
+        out.append(text, at, string::npos);
+        return out;
+    }
+};
+
+// Analyzed documents by ordinal, stored column-wise: one column per fixed-size
+// field, and strings and term arrays concatenated with a start offset per doc,
+// so the table can be used straight from a mapped segment.
+class DocTable {
+private:
+    enum { TITLE, CONTENT, LINK, ACRONYM, FIELDS };
+    Column<int32_t> ids;
+    Column<double> lenFactor;
+    Column<uint64_t> fieldOff;    // FIELDS starts per doc, plus an end sentinel
+    Column<char> fields;
+    Column<uint32_t> vecStart, vecTerms, vecFreq;
+    Column<float> vecTf;
+    Column<uint32_t> titleStart, titleTerms;
+    Column<uint32_t> seqStart, seq;
+    Column<uint32_t> titleLen;    // title tokens, the rest of seq is the body
+    Column<uint32_t> offStart, offsets; // body token byte offsets every kOffsetStride tokens
+    Column<uint32_t> idSlots;     // hash slots holding ordinals, keyed by doc id
+
+    // murmur3's fmix32: masking keeps the low bits, which a plain multiply
+    // leaves weak (ids with a common low part would share a probe run)
+    static size_t hashOf(int id) {
+        uint32_t h = (uint32_t)id;
+        h ^= h >> 16;
+        h *= 0x85ebca6bu;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35u;
+        h ^= h >> 16;
+        return h;
+    }
+
+    void insertSlot(uint32_t ord) {
+        size_t mask = idSlots.size() - 1;
+        size_t i = hashOf(ids[ord]) & mask;
+        while (idSlots[i] != NONE && ids[idSlots[i]] != ids[ord]) i = (i + 1) & mask;
+        idSlots.w(i) = ord; // a later doc with the same id takes over the slot
+    }
+
+    void grow() {
+        idSlots.assign(max<size_t>(16, idSlots.size() * 2), NONE);
+        for (uint32_t ord = 0; ord < size(); ++ord) insertSlot(ord);
+    }
+
+    string_view field(uint32_t ord, int f) const {
+        size_t k = (size_t)ord * FIELDS + f;
+        return string_view(fields.data() + fieldOff[k], fieldOff[k+1] - fieldOff[k]);
+    }
+
+public:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    DocTable() {
+        fieldOff.push_back(0);
+        vecStart.push_back(0);
+        titleStart.push_back(0);
+        seqStart.push_back(0);
+        offStart.push_back(0);
+    }
+
+    uint32_t size() const { return ids.size(); }
+    int id(uint32_t ord) const { return ids[ord]; }
+    string_view acronym(uint32_t ord) const { return field(ord, ACRONYM); }
+    uint32_t bodyLen(uint32_t ord) const { return seqStart[ord+1] - seqStart[ord] - titleLen[ord]; }
+    uint32_t titleLenOf(uint32_t ord) const { return titleLen[ord]; }
+
+    // ordinal of the doc with this id, NONE if there is none
+    uint32_t find(int id) const {
+        if (idSlots.empty()) return NONE;
+        size_t mask = idSlots.size() - 1;
+        for (size_t i = hashOf(id) & mask; idSlots[i] != NONE; i = (i + 1) & mask) {
+            if (ids[idSlots[i]] == id) return idSlots[i];
+        }
+        return NONE;
+    }
+
+    Doc operator[](uint32_t ord) const {
+        Doc d;
+        d.id = ids[ord];
+        d.title = field(ord, TITLE);
+        d.content = field(ord, CONTENT);
+        d.link = field(ord, LINK);
+        d.acronym = field(ord, ACRONYM);
+        d.seq = seq.span(seqStart[ord], seqStart[ord+1]);
+        d.titleLen = titleLen[ord];
+        d.offsets = offsets.span(offStart[ord], offStart[ord+1]);
+        d.titleTerms = titleTerms.span(titleStart[ord], titleStart[ord+1]);
+        d.lenFactor = lenFactor[ord];
+        d.vecTerms = vecTerms.span(vecStart[ord], vecStart[ord+1]);
+        d.vecFreq = vecFreq.span(vecStart[ord], vecStart[ord+1]);
+        d.vecTf = vecTf.span(vecStart[ord], vecStart[ord+1]);
+        return d;
+    }
+
+    void append(const DocRecord &r) {
+        Doc d;
+        d.id = r.id;
+        d.title = r.title;
+        d.content = r.content;
+        d.link = r.link;
+        d.acronym = r.acronym;
+        d.seq = Span<uint32_t>(r.seq.data(), r.seq.size());
+        d.titleLen = r.titleLen;
+        d.offsets = Span<uint32_t>(r.offsets.data(), r.offsets.size());
+        d.titleTerms = Span<uint32_t>(r.titleTerms.data(), r.titleTerms.size());
+        d.lenFactor = r.lenFactor;
+        d.vecTerms = Span<uint32_t>(r.vecTerms.data(), r.vecTerms.size());
+        d.vecFreq = Span<uint32_t>(r.vecFreq.data(), r.vecFreq.size());
+        d.vecTf = Span<float>(r.vecTf.data(), r.vecTf.size());
+        append(d);
+    }
+
+    // copy of a doc of another table
+    void append(const Doc &d) {
+        ids.push_back(d.id);
+        lenFactor.push_back(d.lenFactor);
+        titleLen.push_back(d.titleLen);
+        for (string_view f : {d.title, d.content, d.link, d.acronym}) {
+            fields.append(f.data(), f.data() + f.size());
+            fieldOff.push_back(fields.size());
+        }
+        vecTerms.append(d.vecTerms.begin(), d.vecTerms.end());
+        vecFreq.append(d.vecFreq.begin(), d.vecFreq.end());
+        vecTf.append(d.vecTf.begin(), d.vecTf.end());
+        vecStart.push_back(vecTerms.size());
+        titleTerms.append(d.titleTerms.begin(), d.titleTerms.end());
+        titleStart.push_back(titleTerms.size());
+        seq.append(d.seq.begin(), d.seq.end());
+        seqStart.push_back(seq.size());
+        offsets.append(d.offsets.begin(), d.offsets.end());
+        offStart.push_back(offsets.size());
+        if ((size_t)size() * 2 > idSlots.size()) grow();
+        else insertSlot(size() - 1);
+    }
+
+    size_t byteSize() const {
+        return ids.byteSize() + lenFactor.byteSize() + fieldOff.byteSize() + fields.byteSize() +
+               vecStart.byteSize() + vecTerms.byteSize() + vecFreq.byteSize() + vecTf.byteSize() +
+               titleStart.byteSize() + titleTerms.byteSize() + seqStart.byteSize() + seq.byteSize() +
+               titleLen.byteSize() + offStart.byteSize() + offsets.byteSize();
+    }
+
+    void save(SegmentWriter &w) const {
+        w.add(kSecDocIds, ids);
+        w.add(kSecDocLen, lenFactor);
+        w.add(kSecDocFieldOff, fieldOff);
+        w.add(kSecDocFields, fields);
+        w.add(kSecDocVecStart, vecStart);
+        w.add(kSecDocVecTerms, vecTerms);
+        w.add(kSecDocVecFreq, vecFreq);
+        w.add(kSecDocVecTf, vecTf);
+        w.add(kSecDocTitleStart, titleStart);
+        w.add(kSecDocTitleTerms, titleTerms);
+        w.add(kSecDocSeqStart, seqStart);
+        w.add(kSecDocSeq, seq);
+        w.add(kSecDocIdSlots, idSlots);
+        w.add(kSecDocTitleLen, titleLen);
+        w.add(kSecDocOffStart, offStart);
+        w.add(kSecDocOffsets, offsets);
+    }
+
+    bool map(const SegmentReader &r, string &err) {
+        bool ok = r.map(kSecDocIds, ids, err) && r.map(kSecDocLen, lenFactor, err) &&
+                  r.map(kSecDocFieldOff, fieldOff, err) && r.map(kSecDocFields, fields, err) &&
+                  r.map(kSecDocVecStart, vecStart, err) && r.map(kSecDocVecTerms, vecTerms, err) &&
+                  r.map(kSecDocVecFreq, vecFreq, err) && r.map(kSecDocVecTf, vecTf, err) &&
+                  r.map(kSecDocTitleStart, titleStart, err) && r.map(kSecDocTitleTerms, titleTerms, err) &&
+                  r.map(kSecDocSeqStart, seqStart, err) && r.map(kSecDocSeq, seq, err) &&
+                  r.map(kSecDocIdSlots, idSlots, err) && r.map(kSecDocTitleLen, titleLen, err) &&
+                  r.map(kSecDocOffStart, offStart, err) && r.map(kSecDocOffsets, offsets, err);
+        if (!ok) return false;
+        size_t n = ids.size();
+        if (lenFactor.size() != n || titleLen.size() != n || fieldOff.size() != n * FIELDS + 1 ||
+            vecStart.size() != n + 1 || titleStart.size() != n + 1 || seqStart.size() != n + 1 || offStart.size() != n + 1 ||
+            fieldOff.back() != fields.size() || vecStart.back() != vecTerms.size() || vecFreq.size() != vecTerms.size() ||
+            vecTf.size() != vecTerms.size() || titleStart.back() != titleTerms.size() || seqStart.back() != seq.size() ||
+            offStart.back() != offsets.size() ||
+            (n && (idSlots.size() < n * 2 || (idSlots.size() & (idSlots.size() - 1))))) {
+            err = "inconsistent document columns";
+            return false;
+        }
+        return true;
+    }
+};
+
+// -------------------- Dense retrieval --------------------
+// Optional approximate retrieval over fixed-size document embeddings. The
+// embedding of a doc is a hashed random projection of its tf-idf vector:
+// every term adds its weight, with a pseudo-random sign, to kDenseProbes of
+// the kDenseDim dimensions chosen by a hash of its id. Embeddings are
+// normalized and quantized to int8 with a scale per vector, so the dot
+// product of two codes divided by both scales approximates the cosine of
+// the tf-idf vectors. No model is involved; the projection is fixed.
+const int kDenseDim = 256;     // bytes per code, a multiple of 32
+const int kDenseProbes = 4;    // dimensions each term is projected onto
+
+inline uint64_t mix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// add the projection of a weighted term to v
+inline void projectTerm(float *v, uint32_t term, float w) {
+    uint64_t h = term;
+    for (int p = 0; p < kDenseProbes; ++p) {
+        h = mix64(h);
+        v[h % kDenseDim] += h >> 63 ? -w : w;
+    }
+}
+
+// Quantize v into code, scaled so the largest component maps to 127; the
+// returned scale is code / (v / |v|), 0 for a zero vector
+float quantize(const float *v, int8_t *code) {
+    float norm = 0, top = 0;
+    for (int i = 0; i < kDenseDim; ++i) {
+        norm += v[i] * v[i];
+        top = max(top, fabs(v[i]));
+    }
+    if (top == 0) { memset(code, 0, kDenseDim); return 0; }
+    for (int i = 0; i < kDenseDim; ++i) code[i] = (int8_t)lrintf(v[i] * 127 / top);
+    return 127 * sqrt(norm) / top;
+}
+
+// Dot products of two codes. As for the classify kernels, the widest one
+// the CPU supports is picked at startup.
+int32_t dotScalar(const int8_t *a, const int8_t *b) {
+    int32_t s = 0;
+    for (int i = 0; i < kDenseDim; ++i) s += a[i] * b[i];
+    return s;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// bytes sign-extended to 16 bits, multiplied and summed pairwise into 32-bit lanes
+int32_t dotSse2(const int8_t *a, const int8_t *b) {
+    __m128i acc = _mm_setzero_si128();
+    for (int i = 0; i < kDenseDim; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + i)), y = _mm_loadu_si128((const __m128i*)(b + i));
+        __m128i xl = _mm_srai_epi16(_mm_unpacklo_epi8(x, x), 8), xh = _mm_srai_epi16(_mm_unpackhi_epi8(x, x), 8);
+        __m128i yl = _mm_srai_epi16(_mm_unpacklo_epi8(y, y), 8), yh = _mm_srai_epi16(_mm_unpackhi_epi8(y, y), 8);
+        acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(xl, yl), _mm_madd_epi16(xh, yh)));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4e));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xb1));
+    return _mm_cvtsi128_si32(acc);
+}
+
+__attribute__((target("avx2"))) int32_t dotAvx2(const int8_t *a, const int8_t *b) {
+    __m256i acc = _mm256_setzero_si256();
+    for (int i = 0; i < kDenseDim; i += 32) {
+        __m256i x0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a + i)));
+        __m256i y0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i)));
+        __m256i x1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a + i + 16)));
+        __m256i y1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i + 16)));
+        acc = _mm256_add_epi32(acc, _mm256_add_epi32(_mm256_madd_epi16(x0, y0), _mm256_madd_epi16(x1, y1)));
+    }
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+    return _mm_cvtsi128_si32(s);
+}
+#endif
+
+typedef int32_t (*DotFn)(const int8_t *a, const int8_t *b);
+
+// DENSE_KERNEL=scalar|sse2 forces a narrower kernel
+DotFn pickDot() {
+    const char *force = getenv("DENSE_KERNEL");
+    string f = force ? force : "";
+#if defined(__x86_64__) || defined(__i386__)
+    if (f != "scalar" && f != "sse2" && __builtin_cpu_supports("avx2")) return dotAvx2;
+    if (f != "scalar" && __builtin_cpu_supports("sse2")) return dotSse2;
+#endif
+    return dotScalar;
+}
+
+const DotFn denseDot = pickDot();
+
+// Inverted-file (IVF) index over the embeddings of a segment. Docs are
+// clustered around about sqrt(n) centroids by spherical k-means, and their
+// codes are stored list by list in one contiguous array. A query scores the
+// centroids, then scans the codes of the nprobe closest lists in order;
+// probing more lists finds more of the true neighbours at a linear cost.
+class DenseIndex {
+private:
+    Column<int8_t> centroids;       // list -> code, kDenseDim bytes each
+    Column<float> centroidScale;
+    Column<uint32_t> listStart;     // list -> first slot, plus an end sentinel
+    Column<uint32_t> ords;          // slot -> doc ordinal
+    Column<int8_t> codes;           // slot -> code, kDenseDim bytes each
+    Column<float> scales;           // slot -> scale of its code, 0 for a doc without terms
+
+    static const int kTrainIters = 8;
+    static const uint32_t kTrainPerList = 32; // k-means sample size per centroid
+
+    // the centroid closest to a code
+    static uint32_t nearest(const int8_t *code, const int8_t *cent, const float *cscale, uint32_t lists) {
+        uint32_t best = 0;
+        float bestSim = -HUGE_VALF;
+        for (uint32_t l = 0; l < lists; ++l) {
+            if (cscale[l] == 0) continue;
+            float sim = denseDot(code, cent + (size_t)l * kDenseDim) / cscale[l];
+            if (sim > bestSim) { bestSim = sim; best = l; }
+        }
+        return best;
+    }
+
+    // Spherical k-means over a strided sample of the codes; the centroids
+    // come out quantized like the codes
+    static void train(const vector<int8_t> &code, const vector<float> &scale, uint32_t lists, ThreadPool &pool,
+                      vector<int8_t> &cent, vector<float> &cscale) {
+        vector<uint32_t> sample;
+        for (uint32_t i = 0; i < scale.size(); ++i) if (scale[i] > 0) sample.push_back(i);
+        size_t want = (size_t)lists * kTrainPerList;
+        if (sample.size() > want) {
+            vector<uint32_t> every;
+            for (size_t k = 0; k < want; ++k) every.push_back(sample[k * sample.size() / want]);
+            sample.swap(every);
+        }
+        cent.assign((size_t)lists * kDenseDim, 0);
+        cscale.assign(lists, 0);
+        if (sample.empty()) return;
+        for (uint32_t l = 0; l < lists; ++l) { // spread over the sample
+            uint32_t i = sample[(size_t)l * sample.size() / lists];
+            copy(&code[(size_t)i * kDenseDim], &code[(size_t)(i + 1) * kDenseDim], &cent[(size_t)l * kDenseDim]);
+            cscale[l] = scale[i];
+        }
+        vector<uint32_t> assign(sample.size());
+        vector<float> sum((size_t)lists * kDenseDim);
+        vector<uint32_t> count(lists);
+        int tasks = pool.size() + 1;
+        for (int it = 0; it < kTrainIters; ++it) {
+            pool.parallelFor(tasks, [&](int t) {
+                for (size_t k = sample.size() * t / tasks; k < sample.size() * (t + 1) / tasks; ++k) {
+                    assign[k] = nearest(&code[(size_t)sample[k] * kDenseDim], cent.data(), cscale.data(), lists);
+                }
+            });
+            fill(sum.begin(), sum.end(), 0.0f);
+            fill(count.begin(), count.end(), 0);
+            for (size_t k = 0; k < sample.size(); ++k) {
+                const int8_t *c = &code[(size_t)sample[k] * kDenseDim];
+                float *s = &sum[(size_t)assign[k] * kDenseDim];
+                float inv = 1 / scale[sample[k]];
+                for (int d = 0; d < kDenseDim; ++d) s[d] += c[d] * inv;
+                count[assign[k]]++;
+            }
+            for (uint32_t l = 0; l < lists; ++l) {
+                if (!count[l]) { // an empty list restarts from a sample point
+                    uint32_t i = sample[((size_t)l * 7919 + it) % sample.size()];
+                    for (int d = 0; d < kDenseDim; ++d) sum[(size_t)l * kDenseDim + d] = code[(size_t)i * kDenseDim + d] / scale[i];
+                }
+                cscale[l] = quantize(&sum[(size_t)l * kDenseDim], &cent[(size_t)l * kDenseDim]);
+            }
+        }
+    }
+
+public:
+    uint32_t size() const { return ords.size(); }
+    uint32_t lists() const { return listStart.empty() ? 0 : listStart.size() - 1; }
+
+    size_t byteSize() const {
+        return centroids.byteSize() + centroidScale.byteSize() + listStart.byteSize() + ords.byteSize() +
+               codes.byteSize() + scales.byteSize();
+    }
+
+    // Embed the docs of a table for these idfs. The docs of a segment never
+    // change, so a rebuild after the idfs drifted keeps the lists and only
+    // re-embeds; a first build also clusters the docs.
+    void build(const DocTable &docs, const Column<double> &idf, ThreadPool &pool) {
+        uint32_t n = docs.size();
+        bool keep = ords.size() == n && n > 0;
+        vector<uint32_t> order(n);
+        if (keep) copy(ords.begin(), ords.end(), order.begin());
+        else iota(order.begin(), order.end(), 0);
+        vector<int8_t> code((size_t)n * kDenseDim);
+        vector<float> scale(n);
+        int tasks = pool.size() + 1;
+        pool.parallelFor(tasks, [&](int t) {
+            float v[kDenseDim];
+            for (uint32_t k = (uint64_t)n * t / tasks; k < (uint64_t)n * (t + 1) / tasks; ++k) {
+                Doc d = docs[order[k]];
+                fill(v, v + kDenseDim, 0.0f);
+                for (size_t i = 0; i < d.vecTerms.size(); ++i) projectTerm(v, d.vecTerms[i], d.vecTf[i] * idf[d.vecTerms[i]]);
+                scale[k] = quantize(v, &code[(size_t)k * kDenseDim]);
+            }
+        });
+        if (keep) {
+            codes.assign(move(code));
+            scales.assign(move(scale));
+            return;
+        }
+
+        uint32_t L = max<uint32_t>(1, (uint32_t)lrint(sqrt((double)n)));
+        vector<int8_t> cent;
+        vector<float> cscale;
+        train(code, scale, L, pool, cent, cscale);
+        vector<uint32_t> list(n);
+        pool.parallelFor(tasks, [&](int t) {
+            for (uint32_t i = (uint64_t)n * t / tasks; i < (uint64_t)n * (t + 1) / tasks; ++i) {
+                list[i] = scale[i] > 0 ? nearest(&code[(size_t)i * kDenseDim], cent.data(), cscale.data(), L) : 0;
+            }
+        });
+        vector<uint32_t> start(L + 1, 0);
+        for (uint32_t l : list) start[l + 1]++;
+        for (uint32_t l = 0; l < L; ++l) start[l + 1] += start[l];
+        vector<uint32_t> slotOrd(n), next(start.begin(), start.end() - 1);
+        vector<int8_t> slotCode((size_t)n * kDenseDim);
+        vector<float> slotScale(n);
+        for (uint32_t i = 0; i < n; ++i) {
+            uint32_t s = next[list[i]]++;
+            slotOrd[s] = i;
+            slotScale[s] = scale[i];
+            memcpy(&slotCode[(size_t)s * kDenseDim], &code[(size_t)i * kDenseDim], kDenseDim);
+        }
+        centroids.assign(move(cent));
+        centroidScale.assign(move(cscale));
+        listStart.assign(move(start));
+        ords.assign(move(slotOrd));
+        codes.assign(move(slotCode));
+        scales.assign(move(slotScale));
+    }
+
+    // Push (ordinal, approximate cosine) of the docs in the probes lists
+    // closest to a query code into top, except those skip(ordinal) rejects
+    template <class Skip>
+    void search(const int8_t *q, float qscale, int probes, TopK &top, Skip skip) const {
+        uint32_t L = lists();
+        if (L == 0 || qscale == 0) return;
+        vector<pair<float,uint32_t>> near;
+        near.reserve(L);
+        for (uint32_t l = 0; l < L; ++l) {
+            if (listStart[l] == listStart[l + 1]) continue;
+            near.push_back({centroidScale[l] ? denseDot(q, &centroids[(size_t)l * kDenseDim]) / centroidScale[l] : -HUGE_VALF, l});
+        }
+        size_t p = min<size_t>(max(probes, 1), near.size());
+        partial_sort(near.begin(), near.begin() + p, near.end(), greater<pair<float,uint32_t>>());
+        for (size_t k = 0; k < p; ++k) {
+            uint32_t l = near[k].second;
+            for (uint32_t s = listStart[l]; s < listStart[l + 1]; ++s) {
+                if (scales[s] == 0 || skip(ords[s])) continue;
+                top.push(ords[s], denseDot(q, &codes[(size_t)s * kDenseDim]) / (qscale * scales[s]));
+            }
+            PROFILE_COUNT(bytes, (listStart[l + 1] - listStart[l]) * (size_t)kDenseDim);
+        }
+    }
+
+    void save(SegmentWriter &w) const {
+        w.add(kSecDenseCentroids, centroids);
+        w.add(kSecDenseCentroidScale, centroidScale);
+        w.add(kSecDenseListStart, listStart);
+        w.add(kSecDenseOrds, ords);
+        w.add(kSecDenseCodes, codes);
+        w.add(kSecDenseScales, scales);
+    }
+
+    // an index saved without dense retrieval maps as empty
+    bool map(const SegmentReader &r, uint32_t docs, string &err) {
+        bool ok = r.map(kSecDenseCentroids, centroids, err) && r.map(kSecDenseCentroidScale, centroidScale, err) &&
+                  r.map(kSecDenseListStart, listStart, err) && r.map(kSecDenseOrds, ords, err) &&
+                  r.map(kSecDenseCodes, codes, err) && r.map(kSecDenseScales, scales, err);
+        if (!ok) return false;
+        size_t L = lists(), n = ords.size();
+        if ((n && n != docs) || centroids.size() != L * kDenseDim || centroidScale.size() != L ||
+            codes.size() != n * kDenseDim || scales.size() != n || (L ? listStart.back() != n : n != 0)) {
+            err = "inconsistent dense index";
+            return false;
+        }
+        for (uint32_t o : ords) if (o >= docs) { err = "inconsistent dense index"; return false; }
+        return true;
+    }
+};
+
+// -------------------- Segments --------------------
+// Suffix array over the acronyms of a segment: one entry per (doc, offset),
+// sorted by the acronym suffix starting there. The docs whose acronym
+// contains a string are the entries of one run starting with it, so a
+// lookup costs a binary search plus the matches instead of a scan.
+struct AcronymSuffix {
+    uint32_t ord;
+    uint32_t off;
+};
+
+class AcronymIndex {
+private:
+    Column<AcronymSuffix> suffixes;
+
+    static string_view suffix(const DocTable &docs, AcronymSuffix s) { return docs.acronym(s.ord).substr(s.off); }
+
+public:
+    void build(const DocTable &docs) {
+        vector<AcronymSuffix> v;
+        for (uint32_t ord = 0; ord < docs.size(); ++ord) {
+            for (uint32_t off = 0; off < docs.acronym(ord).size(); ++off) v.push_back({ord, off});
+        }
+        sort(v.begin(), v.end(), [&](AcronymSuffix a, AcronymSuffix b) {
+            int c = suffix(docs, a).compare(suffix(docs, b));
+            return c != 0 ? c < 0 : a.ord < b.ord;
+        });
+        suffixes.assign(move(v));
+    }
+
+    // sorted ordinals of the docs whose acronym contains q
+    vector<int> find(const DocTable &docs, string_view q) const {
+        vector<int> out;
+        if (q.empty()) return out;
+        const AcronymSuffix *it = lower_bound(suffixes.begin(), suffixes.end(), q,
+            [&](AcronymSuffix s, string_view key) { return suffix(docs, s) < key; });
+        for (; it != suffixes.end() && suffix(docs, *it).substr(0, q.size()) == q; ++it) out.push_back(it->ord);
+        sort(out.begin(), out.end());
+        out.erase(unique(out.begin(), out.end()), out.end());
+        return out;
+    }
+
+    size_t byteSize() const { return suffixes.byteSize(); }
+
+    void save(SegmentWriter &w) const { w.add(kSecAcronymSuffixes, suffixes); }
+
+    bool map(const SegmentReader &r, string &err) { return r.map(kSecAcronymSuffixes, suffixes, err); }
+};
+
+// Docs with local ordinals plus their postings, keyed by global term ids.
+// A published segment is never modified: deletes, merges and changes of the
+// corpus-wide idfs produce a new Segment that shares the unchanged columns.
+struct Segment {
+    uint64_t uid = 0;             // identity kept across such copies
+    DocTable docs;
+    PostingIndex postings;
+    Column<uint32_t> terms;       // global term ids with postings here, sorted
+    Column<PostingList> lists;    // parallel to terms
+    AcronymIndex acronyms;        // over docs
+    DenseIndex dense;             // embeddings of docs, empty unless dense retrieval is on
+    uint64_t titleTokens = 0;     // tokens of all titles, deleted docs included
+    uint64_t bodyTokens = 0;      // tokens of all bodies, deleted docs included
+    Column<uint64_t> deleted;     // tombstones, one bit per ordinal
+    uint32_t numDeleted = 0;
+    bool spilled = false;         // used from a segment file, see SearchEngine::setSpill()
+    // The block bounds hold for the idfs and average field lengths they were
+    // computed with; as those drift the bounds are widened by the slacks
+    // instead of being computed again (see SearchEngine::publish()).
+    Column<double> boundIdf;      // parallel to terms, empty until the bounds are computed
+    Column<double> boundLens;     // average title and body tokens
+    Column<double> norms;         // doc tf-idf norms for boundIdf
+    Column<float> fieldNorms;     // BM25F title and body norm of each doc for boundLens, interleaved
+    bool normsExact = false;      // boundIdf is still the idf of every term here
+    bool fieldNormsExact = false; // boundLens are still the average field lengths
+    double normSlack = 1.0;       // factor on the tfLenNorm bounds
+    double fieldSlack = 1.0;      // factor on the bm25 bounds
+
+    uint32_t size() const { return docs.size(); }
+    uint32_t live() const { return size() - numDeleted; }
+    bool isDeleted(uint32_t ord) const { return numDeleted && (deleted[ord >> 6] >> (ord & 63) & 1); }
+
+    // ordinal of the live doc with this id, DocTable::NONE if there is none
+    uint32_t findLive(int id) const {
+        uint32_t ord = docs.find(id);
+        return ord != DocTable::NONE && !isDeleted(ord) ? ord : DocTable::NONE;
+    }
+
+    void markDeleted(uint32_t ord) {
+        if (deleted.empty()) deleted.assign((size() + 63) / 64, 0);
+        uint64_t &w = deleted.w(ord >> 6);
+        if (w >> (ord & 63) & 1) return;
+        w |= 1ull << (ord & 63);
+        numDeleted++;
+    }
+
+    // postings of a term, nullptr if it has none here
+    const PostingList *listOf(uint32_t id) const {
+        const uint32_t *it = lower_bound(terms.begin(), terms.end(), id);
+        return it != terms.end() && *it == id ? &lists[it - terms.begin()] : nullptr;
+    }
+
+    // term frequency of a term in docs[ord], read from the posting lists
+    int termFreq(uint32_t id, uint32_t ord) const {
+        const PostingList *pl = listOf(id);
+        return pl ? postings.freqOf(*pl, ord) : 0;
+    }
+
+    void save(SegmentWriter &w) const {
+        postings.save(w);
+        docs.save(w);
+        w.add(kSecTerms, terms);
+        w.add(kSecLists, lists);
+        acronyms.save(w);
+        dense.save(w);
+        uint64_t tokens[2] = {titleTokens, bodyTokens};
+        w.add(kSecFieldTokens, tokens, sizeof(tokens));
+        w.add(kSecBoundIdf, boundIdf);
+        w.add(kSecBoundLens, boundLens);
+        w.add(kSecBoundNorms, norms);
+        w.add(kSecBoundFieldNorms, fieldNorms);
+    }
+
+    bool map(const SegmentReader &r, string &err) {
+        if (!(postings.map(r, err) && docs.map(r, err) && r.map(kSecTerms, terms, err) && r.map(kSecLists, lists, err) &&
+              acronyms.map(r, err) && dense.map(r, size(), err))) return false;
+        if (terms.size() != lists.size()) { err = "inconsistent term lists"; return false; }
+        Column<uint64_t> tokens;
+        if (!r.map(kSecFieldTokens, tokens, err)) return false;
+        if (tokens.size() != 2) { err = "inconsistent field stats"; return false; }
+        titleTokens = tokens[0];
+        bodyTokens = tokens[1];
+        if (!(r.map(kSecBoundIdf, boundIdf, err) && r.map(kSecBoundLens, boundLens, err) && r.map(kSecBoundNorms, norms, err) &&
+              r.map(kSecBoundFieldNorms, fieldNorms, err))) return false;
+        if (boundIdf.size() != terms.size() || boundLens.size() != 2 || norms.size() != size() || fieldNorms.size() != 2 * size()) {
+            err = "inconsistent bound stats";
+            return false;
+        }
+        return true;
+    }
+};
+
+// -------------------- Caches --------------------
+// Count-min sketch of how often keys were asked for: four rows of byte
+// counters saturating at 15, all halved after every 10 * width additions so
+// old popularity fades. Used for TinyLFU admission below.
+class FrequencySketch {
+private:
+    vector<uint8_t> table; // 4 rows of width counters
+    size_t width;
+    size_t additions = 0;
+
+    size_t slot(uint64_t h, int row) const { return row * width + ((h >> (row * 16)) ^ (h >> 40) * (row + 1)) % width; }
+
+public:
+    explicit FrequencySketch(size_t w = 4096) : table(4 * w), width(w) {}
+
+    void add(uint64_t h) {
+        for (int r = 0; r < 4; ++r) {
+            uint8_t &c = table[slot(h, r)];
+            if (c < 15) c++;
+        }
+        if (++additions >= 10 * width) {
+            for (auto &c : table) c >>= 1;
+            additions /= 2;
+        }
+    }
+
+    int estimate(uint64_t h) const {
+        int e = 15;
+        for (int r = 0; r < 4; ++r) e = min(e, (int)table[slot(h, r)]);
+        return e;
+    }
+};
+
+struct CacheStats {
+    uint64_t hits = 0, misses = 0;
+    uint64_t evictions = 0;
+    uint64_t rejected = 0;  // not admitted: rarer than the entry it would evict
+    size_t entries = 0, bytes = 0, budget = 0;
+};
+
+// Thread-safe LRU map from string keys to values, bounded by an estimated
+// byte size, with TinyLFU admission: when full, a new entry only gets in if
+// it was asked for more often than the least recently used one. Every entry
+// carries the generation it was computed for; a lookup with another
+// generation misses, and drops the entry if it is the older one.
+template <class V>
+class LruCache {
+private:
+    struct Entry {
+        string key;
+        V value;
+        uint64_t gen;
+        size_t bytes;
+    };
+    static const size_t kEntryOverhead = 96; // list node, hash node, bookkeeping
+
+    mutable mutex mu;
+    list<Entry> lru; // most recent first
+    unordered_map<string_view, typename list<Entry>::iterator> byKey; // views into Entry::key
+    FrequencySketch sketch;
+    size_t budget;
+    CacheStats st;
+
+    static uint64_t hashOf(const string &k) { return std::hash<string>()(k) * 0x9E3779B97F4A7C15ull; }
+
+    void erase(typename list<Entry>::iterator it) {
+        st.bytes -= it->bytes;
+        byKey.erase(it->key);
+        lru.erase(it);
+    }
+
+public:
+    explicit LruCache(size_t budgetBytes) : budget(budgetBytes) {}
+
+    bool get(const string &key, uint64_t gen, V &out) {
+        lock_guard<mutex> lock(mu);
+        sketch.add(hashOf(key));
+        auto it = byKey.find(key);
+        if (it == byKey.end() || it->second->gen != gen) {
+            if (it != byKey.end() && it->second->gen < gen) erase(it->second);
+            st.misses++;
+            return false;
+        }
+        lru.splice(lru.begin(), lru, it->second);
+        out = it->second->value;
+        st.hits++;
+        return true;
+    }
+
+    // cost: bytes held by the value outside of the Entry itself
+    void put(const string &key, uint64_t gen, const V &value, size_t cost) {
+        lock_guard<mutex> lock(mu);
+        size_t bytes = key.size() + sizeof(Entry) + kEntryOverhead + cost;
+        auto it = byKey.find(key);
+        if (it != byKey.end()) {
+            if (it->second->gen > gen) return; // a reader of an older snapshot
+            erase(it->second);
+        }
+        if (bytes > budget) { st.rejected++; return; }
+        if (st.bytes + bytes > budget && sketch.estimate(hashOf(key)) <= sketch.estimate(hashOf(lru.back().key))) {
+            st.rejected++;
+            return;
+        }
+        while (st.bytes + bytes > budget) {
+            erase(prev(lru.end()));
+            st.evictions++;
+        }
+        lru.push_front(Entry{key, value, gen, bytes});
+        byKey[lru.front().key] = lru.begin();
+        st.bytes += bytes;
+    }
+
+    void setBudget(size_t b) {
+        lock_guard<mutex> lock(mu);
+        budget = b;
+        while (st.bytes > budget) {
+            erase(prev(lru.end()));
+            st.evictions++;
+        }
+    }
+
+    CacheStats stats() const {
+        lock_guard<mutex> lock(mu);
+        CacheStats s = st;
+        s.entries = lru.size();
+        s.budget = budget;
+        return s;
+    }
+};
+
+// -------------------- Ranking --------------------
+// Rankers an engine can be switched between. The evaluation loop is a
+// template over the ranker's scorer (IndexSnapshot::run), so each ranker gets
+// its own copy of the loop with the per-posting arithmetic inlined.
+enum class Ranker { Classic, Bm25f };
+
+// BM25F over the title and body fields. A term's pseudo frequency in a doc is
+//   tf~ = tfTitle * titleNorm + tfBody * bodyNorm,
+//   fieldNorm = weight / (1 - b + b * fieldLen / avgFieldLen),
+// and it scores idf * tf~ / (k1 + tf~). The field frequencies come from the
+// postings. A segment stores the norms of its docs for the average field
+// lengths of its bounds; once the averages move on, the norms are computed
+// from the field lengths as docs are scored, so no stats change has to
+// rewrite them.
+struct Bm25f {
+    static constexpr double k1 = 1.2;
+    static constexpr double titleWeight = 2.0, titleB = 0.5;
+    static constexpr double bodyWeight = 1.0, bodyB = 0.75;
+
+    static float fieldNorm(double weight, double b, uint32_t len, double avgLen) {
+        return (float)(weight / (1 - b + b * (avgLen > 0 ? len / avgLen : 1.0)));
+    }
+    static float titleNorm(uint32_t len, double avgLen) { return fieldNorm(titleWeight, titleB, len, avgLen); }
+    static float bodyNorm(uint32_t len, double avgLen) { return fieldNorm(bodyWeight, bodyB, len, avgLen); }
+
+    // tf~ / (k1 + tf~) for a posting with freq occurrences, titleFreq of them in the title
+    static float saturate(uint32_t freq, uint32_t titleFreq, float titleNorm, float bodyNorm) {
+        float tf = (float)titleFreq * (titleNorm - bodyNorm) + (float)freq * bodyNorm;
+        return tf / ((float)k1 + tf);
+    }
+
+    static double idf(uint32_t df, int n) { return log(1.0 + (n - df + 0.5) / (df + 0.5)); }
+};
+
+// -------------------- Index snapshots --------------------
+// Everything a query reads. SearchEngine publishes a new snapshot after each
+// refresh or merge; a search keeps the one it started with, so writers never
+// wait for readers and readers never see a half-applied change.
+class IndexSnapshot {
+public:
+    TermDict dict;                  // term <-> term id
+    Column<uint32_t> termDf;        // term id -> docs holding it, over all segments
+    Column<double> termIdf;         // term id -> idf
+    Column<char> stopword;          // term id -> is a stopword
+    vector<shared_ptr<const Segment>> segs;
+    int N = 0;                      // docs in all segments, deleted ones until they are merged away
+    double avgTitleLen = 0, avgBodyLen = 0; // tokens per doc, over the same docs
+    int fuzzyDistance = 1;          // max edit distance for fuzzy term expansion
+    Ranker ranker = Ranker::Classic;
+    int shards = 1;                 // doc-range shards a query is split into, see search()
+    int denseProbes = 0;            // IVF lists a long query probes per segment, 0: dense retrieval off
+    shared_ptr<ThreadPool> pool;    // runs the shards
+    uint64_t generation = 0;        // bumped by every publish, keys the result cache
+    shared_ptr<LruCache<vector<pair<int,double>>>> resultCache; // may be null
+    shared_ptr<LruCache<vector<int>>> phraseCache; // per-segment phrase matches, may be null
+    struct QueryPlan;
+    shared_ptr<LruCache<shared_ptr<const QueryPlan>>> planCache; // may be null
+    bool plans = true;              // run queries through specialized plans, see plan()
+    shared_ptr<QueryMetrics> metrics; // where search() reports profiles, may be null
+
+    bool isStopword(uint32_t id) const { return id < stopword.size() && stopword[id]; }
+    bool indexed(uint32_t id) const { return id < termDf.size() && termDf[id] > 0; }
+
+    double idf(uint32_t id) const {
+        return id < termIdf.size() ? termIdf[id] : 0.0;
+    }
+
+    // indexed terms within fuzzyDistance of token, excluding the token itself; sorted ids
+    vector<uint32_t> fuzzyExpand(const string &token) const {
+        PROFILE_STAGE(FUZZY);
+        vector<uint32_t> ids;
+        if (fuzzyDistance == 0) return ids;
+        for (auto &m : fuzzyTerms(dict, token, fuzzyDistance)) {
+            if (m.second > 0 && indexed(m.first)) ids.push_back(m.first);
+        }
+        sort(ids.begin(), ids.end());
+        return ids;
+    }
+
+    // Indexed terms starting with prefix, the prefix itself excluded: the
+    // kMaxCompletions most frequent ones, sorted by id. The sorted dictionary
+    // lists them as one run, so this costs a seek plus the matches.
+    static const size_t kMaxCompletions = 64;
+
+    vector<uint32_t> prefixExpand(const string &prefix) const {
+        PROFILE_STAGE(FUZZY);
+        vector<uint32_t> ids;
+        for (auto &t : complete(prefix, kMaxCompletions + 1)) {
+            uint32_t id = dict.find(t.first);
+            if (t.first != prefix && ids.size() < kMaxCompletions) ids.push_back(id);
+        }
+        sort(ids.begin(), ids.end());
+        return ids;
+    }
+
+    // Autocomplete: up to limit indexed terms starting with prefix and their
+    // doc counts, most frequent first (ties in term order)
+    vector<pair<string,uint32_t>> complete(const string &prefix, size_t limit = 10) const {
+        vector<pair<string,uint32_t>> out;
+        if (prefix.empty() || limit == 0) return out;
+        dict.forPrefix(prefix, [&](uint32_t id, string_view term) {
+            if (indexed(id)) out.push_back({string(term), termDf[id]});
+        });
+        auto byDf = [](const pair<string,uint32_t> &a, const pair<string,uint32_t> &b) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        };
+        if (out.size() > limit) {
+            partial_sort(out.begin(), out.begin() + limit, out.end(), byDf);
+            out.resize(limit);
+        } else {
+            sort(out.begin(), out.end(), byDf);
+        }
+        return out;
+    }
+
+    struct IndexStats {
+        size_t terms = 0;
+        size_t postings = 0;
+        size_t bytes = 0;     // posting lists
+        size_t posBytes = 0;  // token positions
+        size_t dictBytes = 0; // term dictionary
+        size_t docBytes = 0;  // stored docs, their term arrays and the acronym index
+        size_t denseBytes = 0; // dense retrieval codes and lists
+        size_t segments = 0;
+        size_t deleted = 0;   // docs waiting to be merged away
+    };
+
+    IndexStats indexStats() const {
+        IndexStats s;
+        for (uint32_t df : termDf) {
+            if (df) { s.terms++; s.postings += df; }
+        }
+        for (auto &seg : segs) {
+            s.bytes += seg->postings.byteSize() + seg->terms.byteSize() + seg->lists.byteSize();
+            s.posBytes += seg->postings.positionBytes();
+            s.docBytes += seg->docs.byteSize() + seg->acronyms.byteSize();
+            s.denseBytes += seg->dense.byteSize();
+            s.deleted += seg->numDeleted;
+        }
+        s.dictBytes = dict.byteSize();
+        s.segments = segs.size();
+        return s;
+    }
+
+    // Compute TF-IDF vector for query terms as (term id, weight * idf) sorted by
+    // term id, ready to be dotted with the stored doc vectors
+    vector<pair<uint32_t,double>> queryVector(const vector<uint32_t> &qids) const {
+        vector<uint32_t> ids;
+        for (uint32_t id : qids) if (id != TermDict::NONE && !isStopword(id)) ids.push_back(id);
+        sort(ids.begin(), ids.end());
+        vector<pair<uint32_t,double>> vec;
+        double norm = 0.0;
+        for (size_t i = 0; i < ids.size(); ) {
+            size_t j = i;
+            while (j < ids.size() && ids[j] == ids[i]) j++;
+            double w = (1 + log(j - i)) * idf(ids[i]);
+            if (w != 0) { // skip unindexed terms
+                vec.push_back({ids[i], w});
+                norm += w*w;
+            }
+            i = j;
+        }
+        norm = sqrt(norm);
+        for (auto &x : vec) x.second *= idf(x.first) / norm;
+        return vec;
+    }
+
+    // L2 norm of the tf-idf vector of a doc for the given idfs
+    static double normOf(const Doc &d, const double *idf) {
+        double norm = 0.0;
+        for (size_t k = 0; k < d.vecTerms.size(); ++k) {
+            double w = d.vecTf[k] * idf[d.vecTerms[k]];
+            norm += w*w;
+        }
+        return sqrt(norm);
+    }
+
+    // Cosine similarity between a stored doc vector and a query vector (sorted
+    // merge). The doc norm is the segment's while its idfs are current, and
+    // computed along the merge otherwise, so no change of N or of some dfs
+    // has to rewrite the norms.
+    double cosineSimilarity(const Segment &seg, uint32_t ord, const Doc &d, const vector<pair<uint32_t,double>> &qvec) const {
+        if (seg.normsExact) {
+            if (seg.norms[ord] == 0) return 0.0;
+            double s = 0.0;
+            size_t i = 0, j = 0;
+            while (i < d.vecTerms.size() && j < qvec.size()) {
+                if (d.vecTerms[i] < qvec[j].first) i++;
+                else if (d.vecTerms[i] > qvec[j].first) j++;
+                else s += d.vecTf[i++] * qvec[j++].second;
+            }
+            return s / seg.norms[ord];
+        }
+        const double *idf = termIdf.data();
+        double s = 0.0, norm = 0.0;
+        size_t j = 0;
+        for (size_t i = 0; i < d.vecTerms.size(); ++i) {
+            uint32_t t = d.vecTerms[i];
+            double w = d.vecTf[i] * idf[t];
+            norm += w*w;
+            while (j < qvec.size() && qvec[j].first < t) j++;
+            if (j < qvec.size() && qvec[j].first == t) s += d.vecTf[i] * qvec[j].second;
+        }
+        return norm == 0 || s == 0 ? 0.0 : s / sqrt(norm);
+    }
+
+    // Embedding of a query vector, quantized as the doc codes are; false if
+    // it is empty (no indexed query term)
+    bool embedQuery(const vector<pair<uint32_t,double>> &qvec, int8_t *code, float &scale) const {
+        float v[kDenseDim] = {};
+        for (auto &t : qvec) projectTerm(v, t.first, t.second / idf(t.first)); // qvec carries idf twice
+        scale = quantize(v, code);
+        return scale > 0;
+    }
+
+    // the k live docs of a segment closest to a query embedding in the
+    // probes nearest IVF lists, as sorted ordinals
+    vector<uint32_t> denseCandidates(const Segment &s, const int8_t *q, float qscale, int probes, int k) const {
+        PROFILE_STAGE(DENSE);
+        TopK top(k);
+        s.dense.search(q, qscale, probes, top, [&](uint32_t ord) { return s.isDeleted(ord); });
+        vector<uint32_t> out;
+        for (auto &e : top.sorted()) out.push_back(e.first);
+        sort(out.begin(), out.end());
+        return out;
+    }
+
+    // Dense candidates examined per result, reranked by their exact score
+    static const int kDenseRerank = 10;
+
+    // Semantic search: the top K by tf-idf cosine among the dense candidates
+    // of a query, probing the given number of lists per segment. The segments
+    // must have been embedded (denseProbes > 0 when they were published).
+    vector<pair<int,double>> denseSearch(const string &rawQuery, int topK, int probes) const {
+        vector<uint32_t> qids;
+        for (auto &t : tokenize(rawQuery)) qids.push_back(dict.find(t));
+        vector<pair<uint32_t,double>> qvec = queryVector(qids);
+        TopK top(topK);
+        int8_t q[kDenseDim];
+        float qscale;
+        if (!embedQuery(qvec, q, qscale)) return top.sorted();
+        for (auto &seg : segs) {
+            for (uint32_t ord : denseCandidates(*seg, q, qscale, probes, topK * kDenseRerank)) {
+                top.push(seg->docs.id(ord), cosineSimilarity(*seg, ord, seg->docs[ord], qvec));
+            }
+        }
+        return top.sorted();
+    }
+
+    // Parsed form of a query, shared by candidate generation and scoring
+    struct QueryCtx {
+        string q;
+        bool phraseSearch = false;
+        string phrase;
+        int slop = 0;            // "a b"~N: extra positions allowed between phrase terms
+        vector<string> qtokens;
+        vector<uint32_t> qids;   // term id per token, TermDict::NONE if unknown
+        vector<vector<uint32_t>> fuzzy; // fuzzy expansion per token (sorted term ids)
+        vector<char> prefix;     // token written as token*: its completions join the expansion
+        bool longQuery = false;
+        vector<pair<uint32_t,double>> qvec;
+        bool maybeAcr = false;
+        bool shortform = false;  // the query itself looks like an acronym
+        string qAcr;
+    };
+
+    QueryCtx parseQuery(const string &rawQuery) const {
+        QueryCtx c;
+        c.q = toLower(rawQuery);
+
+        // Detect phrase search (if query inside double quotes)
+        size_t firstQ = rawQuery.find('"');
+        size_t lastQ = rawQuery.rfind('"');
+        if (firstQ != string::npos && lastQ != string::npos && firstQ != lastQ) {
+            c.phraseSearch = true;
+            c.phrase = toLower(rawQuery.substr(firstQ+1, lastQ-firstQ-1));
+            if (lastQ + 1 < rawQuery.size() && rawQuery[lastQ+1] == '~') {
+                size_t end = lastQ + 2;
+                while (end < rawQuery.size() && isdigit((unsigned char)rawQuery[end])) end++;
+                c.slop = atoi(rawQuery.substr(lastQ + 2, end - lastQ - 2).c_str());
+                c.q.erase(lastQ + 1, end - lastQ - 1); // keep the slop out of the keyword tokens
+            }
+        }
+
+        // tokenize raw query for vector/keyword search
+        c.qtokens = tokenize(c.q);
+        set<string> prefixes; // tokens followed by '*'
+        for (size_t p = c.q.find('*'); p != string::npos; p = c.q.find('*', p + 1)) {
+            size_t b = p;
+            while (b > 0 && isalnum((unsigned char)c.q[b-1])) b--;
+            if (b < p) prefixes.insert(c.q.substr(b, p - b));
+        }
+        map<string, vector<uint32_t>> expanded;
+        for (auto &t : c.qtokens) {
+            bool isPrefix = prefixes.count(t);
+            c.qids.push_back(dict.find(t));
+            c.prefix.push_back(isPrefix);
+            string key = isPrefix ? t + '*' : t;
+            auto it = expanded.find(key);
+            if (it == expanded.end()) {
+                vector<uint32_t> ids = fuzzyExpand(t);
+                if (isPrefix) {
+                    vector<uint32_t> more = prefixExpand(t), both;
+                    set_union(ids.begin(), ids.end(), more.begin(), more.end(), back_inserter(both));
+                    ids.swap(both);
+                }
+                it = expanded.emplace(key, move(ids)).first;
+            }
+            c.fuzzy.push_back(it->second);
+        }
+        // build query vector (TF-IDF) if long enough
+        c.longQuery = (rawQuery.size() > 30 || c.qtokens.size() > 3);
+        if (c.longQuery) c.qvec = queryVector(c.qids);
+
+        // Acronym / shortform match
+        // if user wrote uppercase letters no quotes and length <= 6 we assume shortform
+        bool allUpper = true;
+        for (char ch : rawQuery) {
+            if (isalpha((unsigned char)ch) && islower((unsigned char)ch)) { allUpper = false; break; }
+        }
+        if (rawQuery.size() <= 6 && allUpper && rawQuery.find(' ') == string::npos) { // SHORT heuristic
+            c.maybeAcr = c.shortform = true;
+            c.qAcr = toLower(rawQuery);
+        } else {
+            // also build acronym of query tokens (first letters)
+            string acr="";
+            for (size_t i = 0; i < c.qtokens.size(); ++i) {
+                if (!isStopword(c.qids[i]) && !c.qtokens[i].empty()) acr.push_back(c.qtokens[i][0]);
+            }
+            if (!acr.empty()) { c.maybeAcr = true; c.qAcr = acr; }
+        }
+        return c;
+    }
+
+    // Phrase terms must follow in order, with at most slop positions in excess
+    // of their offsets, and end before position limit (the title length for
+    // a phrase in the title). Stopwords are not indexed; for exact phrases
+    // they are checked against the doc's token sequence.
+    struct PhraseTerm {
+        int offset;           // position in the phrase
+        uint32_t id;
+        const uint32_t *pos;  // positions in the current doc (indexed terms only)
+        uint32_t n = 0;
+    };
+
+    static bool positionsMatch(const vector<PhraseTerm> &terms, const vector<PhraseTerm> &stops,
+                               Span<uint32_t> seq, int slop, uint32_t limit) {
+        const PhraseTerm &head = terms[0];
+        for (uint32_t a = 0; a < head.n && head.pos[a] < limit; ++a) {
+            uint32_t prev = head.pos[a];
+            int extra = 0;
+            bool ok = true;
+            for (size_t k = 1; k < terms.size() && ok; ++k) {
+                uint32_t want = prev + (terms[k].offset - terms[k-1].offset);
+                const uint32_t *p = lower_bound(terms[k].pos, terms[k].pos + terms[k].n, want);
+                if (p == terms[k].pos + terms[k].n) return false; // no later start can fit either
+                extra += *p - want;
+                ok = extra <= slop && *p < limit;
+                prev = *p;
+            }
+            for (size_t k = 0; k < stops.size() && ok && slop == 0; ++k) {
+                long sp = (long)head.pos[a] + stops[k].offset - head.offset;
+                ok = sp >= 0 && sp < (long)min<size_t>(seq.size(), limit) && seq[sp] == stops[k].id;
+            }
+            if (ok) return true;
+        }
+        return false;
+    }
+
+    // ordinals of the docs of a segment containing the token sequence as a
+    // phrase (in the title only if title is set), through the phrase cache
+    // when there is one
+    vector<int> phraseDocs(const Segment &s, const vector<string> &tokens, int slop, bool title = false) const {
+        PROFILE_STAGE(PHRASE);
+        if (!phraseCache || tokens.empty()) return matchPhrase(s, tokens, slop, title);
+        // a segment's docs and positions never change under its uid; deletes are applied later
+        string key = to_string(s.uid) + (title ? "~t" : "~") + to_string(slop);
+        for (auto &t : tokens) key += ' ' + t;
+        vector<int> out;
+        if (phraseCache->get(key, 0, out)) return out;
+        out = matchPhrase(s, tokens, slop, title);
+        phraseCache->put(key, 0, out, out.capacity() * sizeof(int));
+        return out;
+    }
+
+    // The rarest term drives a conjunctive walk over the postings, so only
+    // docs holding every term have their positions decoded.
+    vector<int> matchPhrase(const Segment &s, const vector<string> &tokens, int slop, bool title) const {
+        vector<int> out;
+        vector<PhraseTerm> terms, stops;
+        vector<PostingCursor> curs;
+        vector<pair<uint32_t,int>> byDf;
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            uint32_t id = dict.find(tokens[i]);
+            if (isStopword(id)) { stops.push_back({(int)i, id, nullptr}); continue; }
+            const PostingList *pl = s.listOf(id);
+            if (!pl) return out;
+            byDf.push_back({pl->df, (int)curs.size()});
+            terms.push_back({(int)i, id, nullptr});
+            curs.emplace_back(s.postings, *pl);
+        }
+        if (curs.empty()) return out;
+        sort(byDf.begin(), byDf.end());
+        PostingCursor &lead = curs[byDf[0].second];
+        while (!lead.done()) {
+            uint32_t doc = lead.doc();
+            bool all = true;
+            for (size_t k = 1; k < byDf.size() && all; ++k) {
+                PostingCursor &c = curs[byDf[k].second];
+                c.advance(doc);
+                if (c.doc() != doc) { all = false; lead.advance(c.doc()); }
+            }
+            if (!all) continue;
+            for (size_t k = 0; k < curs.size(); ++k) terms[k].pos = curs[k].positions(terms[k].n);
+            Doc d = s.docs[doc];
+            if (positionsMatch(terms, stops, d.seq, slop, title ? d.titleLen : UINT32_MAX)) out.push_back(doc);
+            lead.next();
+        }
+        return out;
+    }
+
+    // Phrase matches of a query in one segment (sorted ordinals)
+    struct PhraseHits {
+        vector<int> phraseDocs;  // docs matching the quoted phrase
+        vector<int> queryDocs;   // docs containing the whole query as a phrase
+        vector<int> acronymDocs; // docs whose acronym contains the query's
+    };
+
+    // Features an evaluator is compiled with. A query plan (see plan())
+    // picks the evaluator whose features its query needs, so the steps of
+    // the others are not even in its code; kPlanGeneric keeps all of them
+    // behind runtime checks of the parsed query.
+    static constexpr unsigned kPlanPhrase = 1;    // quoted phrase matches
+    static constexpr unsigned kPlanWhole = 2;     // whole-query phrase matches
+    static constexpr unsigned kPlanSingle = 4;    // one query term: its own list is the whole-query match
+    static constexpr unsigned kPlanFuzzy = 8;     // fuzzy / prefix expansions
+    static constexpr unsigned kPlanCosine = 16;   // long query: tf-idf cosine
+    static constexpr unsigned kPlanTokens = 32;   // short query: tf-idf per token
+    static constexpr unsigned kPlanGeneric = kPlanPhrase | kPlanWhole | kPlanFuzzy | kPlanCosine | kPlanTokens;
+
+    static constexpr double kPhraseBoost = 3.0, kWholeBoost = 2.0, kAcronymBoost = 2.0;
+
+    struct QueryTerm;
+
+    // Boost from exact phrase / whole-query / acronym matches (before length normalization)
+    static double matchBoost(const PhraseHits &h, int ord) {
+        double score = 0.0;
+        if (binary_search(h.phraseDocs.begin(), h.phraseDocs.end(), ord)) score += kPhraseBoost;
+        if (binary_search(h.queryDocs.begin(), h.queryDocs.end(), ord)) score += kWholeBoost;
+        if (binary_search(h.acronymDocs.begin(), h.acronymDocs.end(), ord)) score += kAcronymBoost;
+        return score;
+    }
+
+    // matchBoost for the features of an evaluator; with kPlanSingle the
+    // whole query matches wherever its term's list is on the doc
+    template <unsigned F>
+    static double matchBoost(const PhraseHits &h, int ord, const QueryCtx &c, QueryTerm *const *at, int n) {
+        double score = 0.0;
+        if constexpr ((F & kPlanPhrase) != 0) {
+            if (binary_search(h.phraseDocs.begin(), h.phraseDocs.end(), ord)) score += kPhraseBoost;
+        }
+        if constexpr ((F & kPlanWhole) != 0) {
+            if (binary_search(h.queryDocs.begin(), h.queryDocs.end(), ord)) score += kWholeBoost;
+        }
+        if constexpr ((F & kPlanSingle) != 0) {
+            for (int k = 0; k < n; ++k) if (at[k]->term == c.qids[0]) { score += kWholeBoost; break; }
+        }
+        if (binary_search(h.acronymDocs.begin(), h.acronymDocs.end(), ord)) score += kAcronymBoost;
+        return score;
+    }
+
+    // true if the two sorted id arrays share an element
+    static bool containsAny(Span<uint32_t> a, const vector<uint32_t> &b) {
+        size_t i = 0, j = 0;
+        while (i < a.size() && j < b.size()) {
+            if (a[i] < b[j]) i++;
+            else if (a[i] > b[j]) j++;
+            else return true;
+        }
+        return false;
+    }
+
+    // frequency in the doc of a query term, from the lists positioned on it
+    static uint32_t freqOn(uint32_t id, QueryTerm *const *at, int n) {
+        if (id == TermDict::NONE) return 0;
+        for (int k = 0; k < n; ++k) if (at[k]->term == id) return at[k]->cur.freq();
+        return 0;
+    }
+
+    // Full score of one document, given the lists positioned on it: every
+    // query term list holding the doc is among them
+    template <unsigned F>
+    double scoreDoc(const Segment &s, const PhraseHits &h, int ord, const QueryCtx &c, QueryTerm *const *at, int n) const {
+        const Doc &d = s.docs[ord];
+
+        // 1) phrase / substring exact match and 2) acronym match boost
+        double score = matchBoost<F>(h, ord, c, at, n);
+
+        // 3) token overlap / tf-idf for keywords or longQuery (cosine similarity)
+        bool cosine;
+        if constexpr ((F & kPlanTokens) == 0) cosine = true;
+        else if constexpr ((F & kPlanCosine) == 0) cosine = false;
+        else cosine = c.longQuery;
+        if (cosine) {
+            if constexpr ((F & kPlanCosine) != 0) {
+                double sim = cosineSimilarity(s, ord, d, c.qvec);
+                score += sim * 5.0; // scale up similarity
+            }
+        } else if constexpr ((F & kPlanTokens) != 0) {
+            // simpler token-based scoring for short queries
+            double tokenScore = 0.0;
+            for (size_t i = 0; i < c.qtokens.size(); ++i) {
+                uint32_t f = freqOn(c.qids[i], at, n);
+                if (f > 0) tokenScore += (1 + log(f)) * idf(c.qids[i]);
+                else if constexpr ((F & kPlanFuzzy) != 0) {
+                    if (containsAny(d.vecTerms, c.fuzzy[i])) tokenScore += 0.3; // reward fuzzy tokens that are close
+                }
+            }
+            score += tokenScore;
+        }
+
+        // 4) small bonus if title contains query tokens (title is more important)
+        for (uint32_t id : c.qids) {
+            if (binary_search(d.titleTerms.begin(), d.titleTerms.end(), id)) score += 0.6;
+        }
+
+        // 5) small length normalization
+        return score * d.lenFactor;
+    }
+
+    // One posting list taking part in WAND. Its score bound for a block is
+    // wTf*tfLen + wTfNorm*tfLenNorm + wLen*len + wBm25*bm25 + wConst, with
+    // the stats-dependent bounds widened by the slacks of the segment.
+    struct QueryTerm {
+        PostingCursor cur;
+        uint32_t term = TermDict::NONE; // query term the list belongs to, NONE for expansions and matches
+        double wTf = 0, wTfNorm = 0, wLen = 0, wBm25 = 0, wConst = 0;
+        double normSlack = 1, fieldSlack = 1;
+        double ub = 0; // bound over the whole list
+
+        QueryTerm(const PostingIndex &ix, const PostingList &pl) : cur(ix, pl) {}
+        QueryTerm(const Segment &s, const PostingList &pl)
+            : cur(s.postings, pl), normSlack(s.normSlack), fieldSlack(s.fieldSlack) {}
+
+        double boundOf(const BlockBound &b) const {
+            return wTf * b.tfLen + wTfNorm * b.tfLenNorm * normSlack + wLen * b.len + wBm25 * b.bm25 * fieldSlack + wConst;
+        }
+
+        // bound of the block that would hold target; last gets its final docID
+        double blockBound(uint32_t target, uint32_t &last) const {
+            uint32_t b = cur.blockFor(target);
+            if (b >= cur.numBlocks()) { last = PostingCursor::END; return 0.0; }
+            last = cur.blockLastDoc(b);
+            return boundOf(cur.blockBound(b));
+        }
+    };
+
+    // Scorers, the template argument of run(). Each one weighs the list of a
+    // query term (with mult occurrences in the query) so that boundOf bounds
+    // its share of the score, tells the slack a token can add outside of the
+    // lists, and scores a doc given the lists positioned on it.
+    struct ClassicScorer {
+        static void weigh(const IndexSnapshot &ix, QueryTerm &qt, int mult, const QueryCtx &c) {
+            qt.wLen = 0.6 * mult;
+            if (c.longQuery) {
+                auto qw = lower_bound(c.qvec.begin(), c.qvec.end(), make_pair(qt.term, 0.0));
+                if (qw != c.qvec.end() && qw->first == qt.term) qt.wTfNorm = 5.0 * qw->second;
+            } else {
+                qt.wTf = mult * ix.idf(qt.term);
+            }
+        }
+
+        static double slack(const IndexSnapshot &ix, uint32_t id, int mult, bool fuzzy, const QueryCtx &c) {
+            double s = 0.0;
+            if (!c.longQuery && fuzzy) s += 0.3 * mult; // fuzzy reward
+            if (!ix.indexed(id) && ix.isStopword(id)) s += 0.6 * mult; // title bonus of an unindexed token
+            return s;
+        }
+
+        template <unsigned F>
+        static double score(const IndexSnapshot &ix, const Segment &s, const PhraseHits &h, uint32_t ord,
+                            const QueryCtx &c, QueryTerm *const *at, int n) {
+            return ix.scoreDoc<F>(s, h, ord, c, at, n);
+        }
+    };
+
+    // BM25F (see Bm25f) plus the phrase / acronym boosts and the fuzzy
+    // reward. Term frequencies come straight from the cursors on the doc.
+    struct Bm25fScorer {
+        static void weigh(const IndexSnapshot &ix, QueryTerm &qt, int mult, const QueryCtx &) {
+            qt.wBm25 = mult * Bm25f::idf(ix.termDf[qt.term], ix.N);
+        }
+
+        static double slack(const IndexSnapshot &, uint32_t, int mult, bool fuzzy, const QueryCtx &) {
+            return fuzzy ? 0.3 * mult : 0.0;
+        }
+
+        template <unsigned F>
+        static double score(const IndexSnapshot &ix, const Segment &s, const PhraseHits &h, uint32_t ord,
+                            const QueryCtx &c, QueryTerm *const *at, int n) {
+            double score = matchBoost<F>(h, ord, c, at, n);
+            float tn, bn; // stored while the average field lengths are those of the bounds
+            if (s.fieldNormsExact) {
+                tn = s.fieldNorms[2 * ord];
+                bn = s.fieldNorms[2 * ord + 1];
+            } else {
+                tn = Bm25f::titleNorm(s.docs.titleLenOf(ord), ix.avgTitleLen);
+                bn = Bm25f::bodyNorm(s.docs.bodyLen(ord), ix.avgBodyLen);
+            }
+            for (int i = 0; i < n; ++i) {
+                const QueryTerm &t = *at[i];
+                if (t.term == TermDict::NONE) continue;
+                score += t.wBm25 * Bm25f::saturate(t.cur.freq(), t.cur.titleFreq(), tn, bn);
+            }
+            if constexpr ((F & kPlanFuzzy) == 0) return score;
+            for (size_t i = 0; i < c.qtokens.size(); ++i) {
+                if (c.fuzzy[i].empty()) continue;
+                bool found = false;
+                for (int k = 0; k < n && !found; ++k) found = c.qids[i] != TermDict::NONE && at[k]->term == c.qids[i];
+                if (!found && containsAny(s.docs[ord].vecTerms, c.fuzzy[i])) score += 0.3; // reward fuzzy tokens that are close
+            }
+            return score;
+        }
+    };
+
+    // Document-at-a-time Block-Max WAND over the ordinals [lo, hi) of a
+    // segment. slack bounds the score a document can collect outside of the
+    // listed terms.
+    template <class Scorer, unsigned F>
+    void evaluateWand(const Segment &s, const PhraseHits &h, vector<QueryTerm> &terms, double slack, const QueryCtx &c,
+                      TopK &top, uint32_t lo = 0, uint32_t hi = PostingCursor::END) const {
+        const double eps = 1e-9;
+        vector<QueryTerm*> order;
+        for (auto &t : terms) {
+            t.ub = t.boundOf(t.cur.list().maxBound);
+            t.cur.advance(lo);
+            if (!t.cur.done()) order.push_back(&t);
+        }
+        auto byDoc = [](const QueryTerm *a, const QueryTerm *b) { return a->cur.doc() < b->cur.doc(); };
+        while (true) {
+            sort(order.begin(), order.end(), byDoc);
+            while (!order.empty() && order.back()->cur.done()) order.pop_back();
+            if (order.empty()) break;
+
+            // pivot: shortest prefix of lists whose bounds could still enter the top K
+            double thr = top.threshold();
+            double acc = slack;
+            int pivot = -1;
+            for (int i = 0; i < (int)order.size(); ++i) {
+                acc += order[i]->ub;
+                if (!top.full() || acc >= thr - eps) { pivot = i; break; }
+            }
+            if (pivot < 0) break;
+            uint32_t pivotDoc = order[pivot]->cur.doc();
+            if (pivotDoc >= hi) break;
+            while (pivot + 1 < (int)order.size() && order[pivot+1]->cur.doc() == pivotDoc) pivot++;
+
+            // block-max check: if the current blocks cannot reach the threshold,
+            // no doc before the end of the nearest block can either
+            if (top.full()) {
+                double blockAcc = slack;
+                uint32_t nextDoc = pivot + 1 < (int)order.size() ? order[pivot+1]->cur.doc() : PostingCursor::END;
+                for (int i = 0; i <= pivot; ++i) {
+                    uint32_t last;
+                    blockAcc += order[i]->blockBound(pivotDoc, last);
+                    if (last != PostingCursor::END) nextDoc = min(nextDoc, last + 1);
+                }
+                if (blockAcc < thr - eps) {
+                    for (int i = 0; i <= pivot; ++i) order[i]->cur.advance(nextDoc);
+                    continue;
+                }
+            }
+
+            if (order[0]->cur.doc() == pivotDoc) {
+                if (!s.isDeleted(pivotDoc)) {
+                    PROFILE_COUNT(candidates, 1);
+                    top.push(s.docs.id(pivotDoc), Scorer::template score<F>(*this, s, h, pivotDoc, c, order.data(), pivot + 1));
+                }
+                for (int i = 0; i <= pivot; ++i) order[i]->cur.next();
+            } else {
+                // move the lagging lists up to the pivot
+                for (int i = 0; i < pivot; ++i) order[i]->cur.advance(pivotDoc);
+            }
+        }
+    }
+
+    // Candidate lists of one segment, see search()
+    struct SegmentQuery {
+        const Segment *seg;
+        vector<QueryTerm> terms;
+        PostingIndex matchIx;
+        PhraseHits hits;
+    };
+
+    // Score the ordinals [lo, hi) of a segment into top: through WAND over the
+    // candidate lists, or every live doc when there are no candidates at all
+    template <class Scorer, unsigned F>
+    void scoreRange(const SegmentQuery &sq, bool wand, double slack, const QueryCtx &c, TopK &top,
+                    uint32_t lo, uint32_t hi) const {
+        const Segment &s = *sq.seg;
+        if (wand) {
+            vector<QueryTerm> terms = sq.terms; // the cursors move
+            evaluateWand<Scorer, F>(s, sq.hits, terms, slack, c, top, lo, hi);
+            return;
+        }
+        for (uint32_t i = lo; i < hi; ++i) {
+            if (s.isDeleted(i)) continue;
+            PROFILE_COUNT(candidates, 1);
+            top.push(s.docs.id(i), Scorer::template score<F>(*this, s, sq.hits, i, c, nullptr, 0));
+        }
+    }
+
+    // Score the given live ordinals of a segment into top, with the
+    // candidate lists moved along to each of them
+    template <class Scorer, unsigned F>
+    void scoreDocs(const SegmentQuery &sq, const vector<uint32_t> &docs, const QueryCtx &c, TopK &top) const {
+        const Segment &s = *sq.seg;
+        vector<QueryTerm> terms = sq.terms;
+        vector<QueryTerm*> on;
+        for (uint32_t d : docs) {
+            on.clear();
+            for (auto &t : terms) {
+                t.cur.advance(d);
+                if (t.cur.doc() == d) on.push_back(&t);
+            }
+            PROFILE_COUNT(candidates, 1);
+            top.push(s.docs.id(d), Scorer::template score<F>(*this, s, sq.hits, d, c, on.data(), on.size()));
+        }
+    }
+
+    // Search interface. Results are cached per generation under the exact
+    // query text: case, spacing and length all steer parseQuery, so two
+    // spellings of a query are only the same query if they are equal.
+    vector<pair<int,double>> search(const string &rawQuery, int topK = 10) const {
+        QueryProfile p;
+        string key;
+        vector<pair<int,double>> out;
+        search(rawQuery, topK, p, key, out);
+        return out;
+    }
+
+    // search() into caller-owned buffers, filling in the profile of the query
+    // (only the total when profiling is compiled out); key is scratch space
+    // for the cache key. A cache hit allocates nothing once the buffers have
+    // grown, which is what a server reusing them per connection relies on.
+    void search(const string &rawQuery, int topK, QueryProfile &p, string &key, vector<pair<int,double>> &out) const {
+        ProfileScope scope(&p);
+        auto t0 = chrono::steady_clock::now();
+        if (resultCache) {
+            char n[16];
+            key.assign(n, snprintf(n, sizeof(n), "%d~", topK));
+            key += rawQuery;
+        }
+        if (resultCache && resultCache->get(key, generation, out)) {
+            p.cached = true;
+        } else {
+            out = execute(rawQuery, topK);
+            if (resultCache) resultCache->put(key, generation, out, out.size() * sizeof(out[0]));
+        }
+        p.totalNs = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - t0).count();
+        if (SEARCH_PROFILE && metrics) metrics->observe(p);
+    }
+
+    // Explain mode: run a query past the result cache and return where its
+    // time went. Not counted in the metrics.
+    vector<pair<int,double>> explain(const string &rawQuery, int topK, QueryProfile &p) const {
+        ProfileScope scope(&p);
+        auto t0 = chrono::steady_clock::now();
+        auto out = execute(rawQuery, topK);
+        p.totalNs = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - t0).count();
+        return out;
+    }
+
+    vector<pair<int,double>> execute(const string &rawQuery, int topK) const {
+        shared_ptr<const QueryPlan> p = plan(rawQuery);
+        return (this->*p->eval)(*p, topK);
+    }
+
+    template <class Scorer, unsigned F>
+    vector<pair<int,double>> run(const QueryCtx &c, int topK) const {
+        TopK top(topK);
+
+        // Candidate docs are the union of the lists below: the query tokens,
+        // fuzzy neighbours of unknown tokens, and exact phrase/substring/acronym hits.
+        // Weights come from corpus-wide stats, so every segment runs through
+        // WAND on its own lists and all of them feed the same top K.
+        map<string,int> mult, first;
+        for (size_t i = 0; i < c.qtokens.size(); ++i) {
+            if (!mult[c.qtokens[i]]++) first[c.qtokens[i]] = i;
+        }
+        double slack = 0.0;
+        for (auto &m : mult) slack += Scorer::slack(*this, dict.find(m.first), m.second, !c.fuzzy[first[m.first]].empty(), c);
+        vector<string> phraseTokens;
+        if constexpr ((F & kPlanPhrase) != 0) phraseTokens = tokenize(c.phrase);
+        deque<SegmentQuery> queries; // stable addresses, the cursors point into matchIx
+        bool anyCandidate = false;
+        for (auto &seg : segs) {
+            PROFILE_STAGE(CANDIDATES);
+            const Segment &s = *seg;
+            queries.emplace_back();
+            SegmentQuery &sq = queries.back();
+            sq.seg = &s;
+            for (auto &m : mult) {
+                uint32_t id = dict.find(m.first);
+                const PostingList *pl = s.listOf(id);
+                if (!pl) continue;
+                QueryTerm qt(s, *pl);
+                qt.term = id;
+                Scorer::weigh(*this, qt, m.second, c);
+                if constexpr ((F & kPlanSingle) != 0) qt.wConst += kWholeBoost; // its docs are the whole-query matches
+                sq.terms.push_back(qt);
+            }
+            // fuzzy candidates: if token doesn't exist in index, add the docs of its expansion
+            if constexpr ((F & kPlanFuzzy) != 0) {
+                for (auto &m : mult) {
+                    if (indexed(dict.find(m.first)) && !c.prefix[first[m.first]]) continue;
+                    for (uint32_t id : c.fuzzy[first[m.first]]) {
+                        if (const PostingList *pl = s.listOf(id)) sq.terms.push_back(QueryTerm(s, *pl)); // scored through slack
+                    }
+                }
+            }
+            // phrase / whole-query / acronym candidates
+            vector<pair<int,int>> matched;
+            double maxBoost = 0.0;
+            vector<int> hits;
+            if constexpr ((F & kPlanPhrase) != 0) {
+                if (c.phraseSearch) sq.hits.phraseDocs = phraseDocs(s, phraseTokens, c.slop);
+            }
+            if constexpr ((F & kPlanWhole) != 0) {
+                if (!c.phraseSearch) sq.hits.queryDocs = phraseDocs(s, c.qtokens, 0);
+            }
+            hits.insert(hits.end(), sq.hits.phraseDocs.begin(), sq.hits.phraseDocs.end());
+            hits.insert(hits.end(), sq.hits.queryDocs.begin(), sq.hits.queryDocs.end());
+            if (c.maybeAcr) {
+                PROFILE_STAGE(ACRONYM);
+                sq.hits.acronymDocs = s.acronyms.find(s.docs, c.qAcr); // acronyms are lowercase
+            }
+            hits.insert(hits.end(), sq.hits.acronymDocs.begin(), sq.hits.acronymDocs.end());
+            sort(hits.begin(), hits.end());
+            hits.erase(unique(hits.begin(), hits.end()), hits.end());
+            for (int i : hits) {
+                matched.push_back({i, 1});
+                maxBoost = max(maxBoost, matchBoost(sq.hits, i));
+            }
+            if (!matched.empty()) {
+                QueryTerm qt(sq.matchIx, sq.matchIx.add(matched));
+                qt.wConst = maxBoost;
+                sq.terms.push_back(qt);
+            }
+            for (auto &t : sq.terms) if (!t.cur.done()) { anyCandidate = true; break; }
+        }
+        // Dense mode: a long query is scored on the docs closest to its
+        // embedding in each segment instead of going through WAND
+        if constexpr ((F & kPlanCosine) != 0) {
+            int8_t qcode[kDenseDim];
+            float qscale;
+            if (denseProbes > 0 && c.longQuery && !c.phraseSearch && embedQuery(c.qvec, qcode, qscale)) {
+                {
+                    PROFILE_STAGE(SCORE);
+                    for (auto &sq : queries) {
+                        scoreDocs<Scorer, F>(sq, denseCandidates(*sq.seg, qcode, qscale, denseProbes, topK * kDenseRerank), c, top);
+                    }
+                }
+                PROFILE_STAGE(MERGE);
+                return top.sorted();
+            }
+        }
+
+        // If no candidates found but there are docs, fallback to all docs (so we can compute similarity)
+        bool wand = anyCandidate;
+
+        if (shards <= 1 || !pool) {
+            {
+                PROFILE_STAGE(SCORE);
+                for (auto &sq : queries) scoreRange<Scorer, F>(sq, wand, slack, c, top, 0, sq.seg->size());
+            }
+            PROFILE_STAGE(MERGE);
+            return top.sorted();
+        }
+        // Doc-range sharding: the ordinals of every segment are cut into
+        // ranges of about N / shards docs, each scored into its own top K by
+        // whichever worker takes it next. Every doc of a range is judged
+        // exactly as in a serial run, and TopK breaks score ties by id, so
+        // merging the per-range heaps gives the serial result.
+        struct Range { const SegmentQuery *sq; uint32_t lo, hi; };
+        vector<Range> ranges;
+        uint32_t step = max<uint32_t>(1, (N + shards - 1) / shards);
+        for (auto &sq : queries) {
+            for (uint32_t lo = 0; lo < sq.seg->size(); lo += step) ranges.push_back({&sq, lo, min(sq.seg->size(), lo + step)});
+        }
+        vector<TopK> tops(ranges.size(), TopK(topK));
+        vector<QueryProfile> profiles(QueryProfile::active ? ranges.size() : 0); // counters of the workers
+        {
+            PROFILE_STAGE(SCORE);
+            pool->parallelFor(ranges.size(), [&](int r) {
+                ProfileScope scope(profiles.empty() ? nullptr : &profiles[r]);
+                scoreRange<Scorer, F>(*ranges[r].sq, wand, slack, c, tops[r], ranges[r].lo, ranges[r].hi);
+            });
+        }
+        for (auto &p : profiles) QueryProfile::active->add(p);
+        PROFILE_STAGE(MERGE);
+        for (auto &t : tops) {
+            for (auto &e : t.sorted()) top.push(e.first, e.second);
+        }
+        return top.sorted();
+    }
+
+    // Boolean queries: operands combined with AND, OR, NOT and parentheses,
+    // where operands next to each other are ANDed. An operand is a word, a
+    // quoted phrase, or either one after "title:" to match titles only. A
+    // word that tokenizes into several terms needs all of them; stopwords are
+    // not indexed and drop out.
+    struct BoolNode {
+        enum Kind { TERM, TITLE, PHRASE, TITLE_PHRASE, AND, OR, NOT } kind = AND;
+        vector<string> tokens;  // TERM and TITLE: one, PHRASE and TITLE_PHRASE: the phrase
+        vector<BoolNode> kids;
+    };
+
+    // true if the query uses the boolean syntax rather than plain keywords
+    static bool isBooleanQuery(const string &q) {
+        if (q.find('(') != string::npos || q.find("title:") != string::npos) return true;
+        stringstream ss(q);
+        string w;
+        int words = 0;
+        bool op = false;
+        while (ss >> w) {
+            words++;
+            op |= w == "AND" || w == "OR" || w == "NOT";
+        }
+        return op && words > 1;
+    }
+
+    class BoolParser {
+    private:
+        const IndexSnapshot &ix;
+        vector<string> lex; // "(", ")", "\"phrase", words
+        size_t at = 0;
+
+        bool peek(const char *s) const { return at < lex.size() && lex[at] == s; }
+
+        // a leaf, or nothing (kids-less AND) if all its tokens are stopwords
+        BoolNode leaf(BoolNode::Kind kind, const string &text) {
+            BoolNode n;
+            vector<string> toks;
+            for (auto &t : tokenize(text)) if (!ix.isStopword(ix.dict.find(t))) toks.push_back(t);
+            if (toks.empty()) return n;
+            if (kind == BoolNode::PHRASE || kind == BoolNode::TITLE_PHRASE) {
+                n.kind = kind;
+                n.tokens = tokenize(text); // stopwords are checked against the doc sequence
+                return n;
+            }
+            for (auto &t : toks) {
+                BoolNode k;
+                k.kind = kind;
+                k.tokens = {t};
+                n.kids.push_back(move(k));
+            }
+            return n.kids.size() == 1 ? move(n.kids[0]) : n;
+        }
+
+        bool primary(BoolNode &n) {
+            if (at >= lex.size()) return false;
+            string w = lex[at++];
+            if (w == "(") {
+                if (!orExpr(n) || !peek(")")) return false;
+                at++;
+                return true;
+            }
+            if (w == ")") return false;
+            BoolNode::Kind kind = BoolNode::TERM;
+            if (w.compare(0, 6, "title:") == 0) {
+                kind = BoolNode::TITLE;
+                w.erase(0, 6);
+                if (w.empty() && at < lex.size() && lex[at][0] == '"') w = lex[at++];
+            }
+            if (!w.empty() && w[0] == '"') n = leaf(kind == BoolNode::TITLE ? BoolNode::TITLE_PHRASE : BoolNode::PHRASE, w.substr(1));
+            else n = leaf(kind, w);
+            return true;
+        }
+
+        bool unary(BoolNode &n) {
+            if (peek("NOT")) {
+                at++;
+                BoolNode k;
+                if (!unary(k)) return false;
+                n = BoolNode();
+                n.kind = BoolNode::NOT;
+                n.kids.push_back(move(k));
+                return true;
+            }
+            return primary(n);
+        }
+
+        bool andExpr(BoolNode &n) {
+            n = BoolNode();
+            BoolNode k;
+            if (!unary(k)) return false;
+            n.kids.push_back(move(k));
+            while (at < lex.size() && !peek(")") && !peek("OR")) {
+                if (peek("AND")) at++;
+                if (!unary(k)) return false;
+                n.kids.push_back(move(k));
+            }
+            simplify(n);
+            return true;
+        }
+
+        bool orExpr(BoolNode &n) {
+            n = BoolNode();
+            n.kind = BoolNode::OR;
+            BoolNode k;
+            if (!andExpr(k)) return false;
+            n.kids.push_back(move(k));
+            while (peek("OR")) {
+                at++;
+                if (!andExpr(k)) return false;
+                n.kids.push_back(move(k));
+            }
+            simplify(n);
+            return true;
+        }
+
+        // drop empty operands, and the node itself if one operand is left
+        static void simplify(BoolNode &n) {
+            auto empty = [](const BoolNode &k) { return k.kind == BoolNode::AND && k.kids.empty(); };
+            n.kids.erase(remove_if(n.kids.begin(), n.kids.end(), empty), n.kids.end());
+            if (n.kids.size() == 1) { BoolNode k = move(n.kids[0]); n = move(k); }
+            else if (n.kids.empty()) n = BoolNode();
+        }
+
+    public:
+        BoolParser(const IndexSnapshot &ix, const string &q) : ix(ix) {
+            for (size_t i = 0; i < q.size(); ) {
+                char ch = q[i];
+                if (isspace((unsigned char)ch)) { i++; continue; }
+                if (ch == '(' || ch == ')') { lex.push_back(string(1, ch)); i++; continue; }
+                if (ch == '"') {
+                    size_t end = q.find('"', i + 1);
+                    if (end == string::npos) end = q.size();
+                    lex.push_back(q.substr(i, end - i)); // keeps the opening quote as a marker
+                    i = end + 1;
+                    continue;
+                }
+                size_t j = i;
+                while (j < q.size() && !isspace((unsigned char)q[j]) && q[j] != '(' && q[j] != ')' && q[j] != '"') j++;
+                lex.push_back(q.substr(i, j - i));
+                i = j;
+            }
+        }
+
+        // false on a syntax error (unbalanced parentheses, dangling operator)
+        bool parse(BoolNode &root) { return orExpr(root) && at == lex.size(); }
+    };
+
+    // Positive operands of a boolean query (the ones not under a NOT), in order
+    static void positiveTokens(const BoolNode &n, vector<string> &out) {
+        if (n.kind == BoolNode::NOT) return;
+        out.insert(out.end(), n.tokens.begin(), n.tokens.end());
+        for (auto &k : n.kids) positiveTokens(k, out);
+    }
+
+    // estimated number of docs of a segment matching n, used to order intersections
+    uint64_t boolCost(const Segment &s, const BoolNode &n) const {
+        switch (n.kind) {
+        case BoolNode::TERM: case BoolNode::TITLE: {
+            const PostingList *pl = s.listOf(dict.find(n.tokens[0]));
+            return pl ? pl->df : 0;
+        }
+        case BoolNode::PHRASE: case BoolNode::TITLE_PHRASE: {
+            uint64_t c = s.size();
+            for (auto &t : n.tokens) {
+                uint32_t id = dict.find(t);
+                if (isStopword(id)) continue;
+                const PostingList *pl = s.listOf(id);
+                c = min<uint64_t>(c, pl ? pl->df : 0);
+            }
+            return c;
+        }
+        case BoolNode::AND: {
+            uint64_t c = s.size();
+            for (auto &k : n.kids) if (k.kind != BoolNode::NOT) c = min(c, boolCost(s, k));
+            return c;
+        }
+        case BoolNode::OR: {
+            uint64_t c = 0;
+            for (auto &k : n.kids) c += boolCost(s, k);
+            return min<uint64_t>(c, s.size());
+        }
+        case BoolNode::NOT: return s.size();
+        }
+        return s.size();
+    }
+
+    // keep the docs of a sorted list that do (keep = true) or do not appear
+    // in the postings of a TERM / TITLE leaf; the cursor gallops over the skips
+    void filterByTerm(const Segment &s, const BoolNode &n, vector<uint32_t> &docs, bool keep) const {
+        uint32_t id = dict.find(n.tokens[0]);
+        const PostingList *pl = s.listOf(id);
+        if (!pl) { if (keep) docs.clear(); return; }
+        PostingCursor cur(s.postings, *pl);
+        size_t w = 0;
+        for (uint32_t d : docs) {
+            cur.advance(d);
+            bool in = cur.doc() == d && (n.kind != BoolNode::TITLE || cur.titleFreq() > 0);
+            if (in == keep) docs[w++] = d;
+        }
+        docs.resize(w);
+    }
+
+    // a := a AND b (keep) or a AND NOT b, both sorted; gallops through b
+    static void gallopIntersect(vector<uint32_t> &a, const vector<uint32_t> &b, bool keep) {
+        size_t w = 0, j = 0;
+        for (uint32_t d : a) {
+            size_t step = 1, hi = j;
+            while (hi < b.size() && b[hi] < d) { j = hi + 1; hi += step; step *= 2; }
+            j = lower_bound(b.begin() + j, b.begin() + min(hi, b.size()), d) - b.begin();
+            bool in = j < b.size() && b[j] == d;
+            if (in == keep) a[w++] = d;
+        }
+        a.resize(w);
+    }
+
+    // sorted ordinals of a segment matching n (deleted docs included)
+    vector<uint32_t> boolDocs(const Segment &s, const BoolNode &n) const {
+        vector<uint32_t> out;
+        switch (n.kind) {
+        case BoolNode::TERM: case BoolNode::TITLE: {
+            uint32_t id = dict.find(n.tokens[0]);
+            const PostingList *pl = s.listOf(id);
+            if (!pl) return out;
+            for (PostingCursor cur(s.postings, *pl); !cur.done(); cur.next()) {
+                if (n.kind == BoolNode::TERM || cur.titleFreq() > 0) out.push_back(cur.doc());
+            }
+            return out;
+        }
+        case BoolNode::PHRASE: case BoolNode::TITLE_PHRASE:
+            for (int d : phraseDocs(s, n.tokens, 0, n.kind == BoolNode::TITLE_PHRASE)) out.push_back(d);
+            return out;
+        case BoolNode::OR:
+            for (auto &k : n.kids) {
+                vector<uint32_t> more = boolDocs(s, k), both;
+                set_union(out.begin(), out.end(), more.begin(), more.end(), back_inserter(both));
+                out.swap(both);
+            }
+            return out;
+        case BoolNode::NOT: {
+            BoolNode all; // AND of only the negation
+            all.kids.push_back(n);
+            return boolDocs(s, all);
+        }
+        case BoolNode::AND: {
+            // the rarest operand drives, the others filter it in increasing cost
+            vector<pair<uint64_t, const BoolNode*>> pos;
+            vector<const BoolNode*> neg;
+            for (auto &k : n.kids) {
+                if (k.kind == BoolNode::NOT) neg.push_back(&k.kids[0]);
+                else pos.push_back({boolCost(s, k), &k});
+            }
+            if (n.kids.empty()) return out;
+            sort(pos.begin(), pos.end(), [](const pair<uint64_t, const BoolNode*> &a, const pair<uint64_t, const BoolNode*> &b) {
+                return a.first < b.first;
+            });
+            if (pos.empty()) {
+                out.resize(s.size());
+                iota(out.begin(), out.end(), 0);
+            } else {
+                out = boolDocs(s, *pos[0].second);
+            }
+            for (size_t i = 1; i < pos.size() && !out.empty(); ++i) {
+                const BoolNode &k = *pos[i].second;
+                if (k.kind == BoolNode::TERM || k.kind == BoolNode::TITLE) filterByTerm(s, k, out, true);
+                else gallopIntersect(out, boolDocs(s, k), true);
+            }
+            for (size_t i = 0; i < neg.size() && !out.empty(); ++i) {
+                const BoolNode &k = *neg[i];
+                if (k.kind == BoolNode::TERM || k.kind == BoolNode::TITLE) filterByTerm(s, k, out, false);
+                else gallopIntersect(out, boolDocs(s, k), false);
+            }
+            return out;
+        }
+        }
+        return out;
+    }
+
+    // Score exactly the docs matching a boolean query. The positive operands
+    // are scored as a keyword query would score them; their cursors move
+    // forward with the matches, so each posting is decoded at most once.
+    template <class Scorer>
+    vector<pair<int,double>> runBoolean(const BoolNode &root, int topK) const {
+        vector<string> toks;
+        positiveTokens(root, toks);
+        string text;
+        for (auto &t : toks) text += (text.empty() ? "" : " ") + t;
+        QueryCtx c;
+        {
+            PROFILE_STAGE(PARSE);
+            c = parseQuery(text);
+        }
+        map<string,int> mult;
+        for (auto &t : c.qtokens) mult[t]++;
+        TopK top(topK);
+        for (auto &seg : segs) {
+            const Segment &s = *seg;
+            vector<uint32_t> docs;
+            {
+                PROFILE_STAGE(MATCH);
+                docs = boolDocs(s, root);
+            }
+            if (docs.empty()) continue;
+            PhraseHits h;
+            h.queryDocs = phraseDocs(s, c.qtokens, 0);
+            if (c.maybeAcr) {
+                PROFILE_STAGE(ACRONYM);
+                h.acronymDocs = s.acronyms.find(s.docs, c.qAcr);
+            }
+            vector<QueryTerm> terms;
+            for (auto &m : mult) {
+                uint32_t id = dict.find(m.first);
+                const PostingList *pl = s.listOf(id);
+                if (!pl) continue;
+                terms.emplace_back(s, *pl);
+                terms.back().term = id;
+                Scorer::weigh(*this, terms.back(), m.second, c);
+            }
+            PROFILE_STAGE(SCORE);
+            vector<QueryTerm*> on;
+            for (uint32_t d : docs) {
+                if (s.isDeleted(d)) continue;
+                on.clear();
+                for (auto &t : terms) {
+                    t.cur.advance(d);
+                    if (t.cur.doc() == d) on.push_back(&t);
+                }
+                PROFILE_COUNT(candidates, 1);
+                top.push(s.docs.id(d), Scorer::template score<kPlanGeneric>(*this, s, h, d, c, on.data(), on.size()));
+            }
+        }
+        return top.sorted();
+    }
+
+    // Query plans. A query is parsed and classified once into a shape, and
+    // bound to the evaluator compiled for the features its shape needs (see
+    // kPlanPhrase...): a one-term query skips the whole-query phrase match,
+    // a short one the cosine path, a query without close terms the fuzzy
+    // rewards. Plans hold the term ids and expansions of one snapshot, so
+    // the plan cache keys them by generation like the result cache.
+    enum class QueryShape { Single, Multi, Long, Phrase, Acronym, Fuzzy, Boolean, SHAPES };
+    static constexpr const char *shapeNames[(int)QueryShape::SHAPES] = {"single", "multi", "long", "phrase", "acronym", "fuzzy", "boolean"};
+
+    struct QueryPlan {
+        QueryShape shape = QueryShape::Multi;
+        QueryCtx c;
+        BoolNode root;  // Boolean only
+        vector<pair<int,double>> (IndexSnapshot::*eval)(const QueryPlan &, int) const = nullptr;
+
+        size_t bytes() const { // rough heap size, for the cache budget
+            size_t n = sizeof(*this) + c.q.size() + c.phrase.size() + c.qAcr.size() + c.qvec.size() * 16;
+            for (size_t i = 0; i < c.qtokens.size(); ++i) n += c.qtokens[i].size() + 48 + c.fuzzy[i].size() * 4;
+            return n;
+        }
+    };
+
+    template <class Scorer, unsigned F>
+    vector<pair<int,double>> evalPlan(const QueryPlan &p, int topK) const { return run<Scorer, F>(p.c, topK); }
+
+    template <class Scorer>
+    vector<pair<int,double>> evalBoolean(const QueryPlan &p, int topK) const { return runBoolean<Scorer>(p.root, topK); }
+
+    // the evaluator for a plan's query, the generic one unless plans are on
+    template <class Scorer>
+    void bind(QueryPlan &p) const {
+        const QueryCtx &c = p.c;
+        if (p.shape == QueryShape::Boolean) { p.eval = &IndexSnapshot::evalBoolean<Scorer>; return; }
+        p.eval = &IndexSnapshot::evalPlan<Scorer, kPlanGeneric>;
+        if (!plans || c.phraseSearch) return;
+        if (c.longQuery) { p.eval = &IndexSnapshot::evalPlan<Scorer, kPlanWhole | kPlanCosine | kPlanFuzzy>; return; }
+        bool fuzzy = false;
+        for (auto &f : c.fuzzy) fuzzy |= !f.empty();
+        if (c.qtokens.size() == 1 && indexed(c.qids[0])) {
+            p.eval = fuzzy ? &IndexSnapshot::evalPlan<Scorer, kPlanSingle | kPlanTokens | kPlanFuzzy>
+                           : &IndexSnapshot::evalPlan<Scorer, kPlanSingle | kPlanTokens>;
+        } else {
+            p.eval = fuzzy ? &IndexSnapshot::evalPlan<Scorer, kPlanWhole | kPlanTokens | kPlanFuzzy>
+                           : &IndexSnapshot::evalPlan<Scorer, kPlanWhole | kPlanTokens>;
+        }
+    }
+
+    shared_ptr<const QueryPlan> plan(const string &rawQuery) const {
+        shared_ptr<const QueryPlan> cached;
+        if (plans && planCache && planCache->get(rawQuery, generation, cached)) return cached;
+        auto p = make_shared<QueryPlan>();
+        {
+            PROFILE_STAGE(PARSE);
+            if (isBooleanQuery(rawQuery) && BoolParser(*this, rawQuery).parse(p->root)) p->shape = QueryShape::Boolean;
+        }
+        if (p->shape != QueryShape::Boolean) {
+            {
+                PROFILE_STAGE(PARSE);
+                p->c = parseQuery(rawQuery);
+            }
+            const QueryCtx &c = p->c;
+            bool unknown = false; // a token only its expansions can match
+            for (size_t i = 0; i < c.qtokens.size(); ++i) {
+                unknown |= !c.fuzzy[i].empty() && (c.prefix[i] || !indexed(c.qids[i]));
+            }
+            p->shape = c.phraseSearch ? QueryShape::Phrase : c.shortform ? QueryShape::Acronym :
+                       c.longQuery ? QueryShape::Long : unknown ? QueryShape::Fuzzy :
+                       c.qtokens.size() == 1 ? QueryShape::Single : QueryShape::Multi;
+        }
+        if (ranker == Ranker::Bm25f) bind<Bm25fScorer>(*p);
+        else bind<ClassicScorer>(*p);
+        if (plans && planCache) planCache->put(rawQuery, generation, p, p->bytes());
+        return p;
+    }
+
+    QueryShape shapeOf(const string &rawQuery) const { return plan(rawQuery)->shape; }
+
+    // Query-aware snippets of result docs, one per id (empty if the doc is
+    // gone). The query terms and their fuzzy/prefix expansions that occur in
+    // a doc have their positions read from the postings; the window of
+    // kSnippetTokens body tokens that covers the most (idf-weighted) distinct
+    // terms is cut out of the content starting at the offset checkpoint
+    // before it, so a snippet costs O(snippet), not O(document).
+    static const int kSnippetTokens = 24;
+    static const size_t kSnippetBytes = 320;
+
+    // Buffers a snippet is built in; callers that render many keep one so the
+    // steady state does not allocate.
+    struct SnippetScratch {
+        vector<pair<uint32_t,double>> terms; // (term, weight), a term once with its best weight
+        vector<pair<uint32_t,uint32_t>> hits, marks;
+        vector<int> inWindow;
+        PostingCursor cur;
+    };
+
+    vector<Snippet> snippets(const string &rawQuery, const vector<int> &ids) const {
+        vector<Snippet> out(ids.size());
+        SnippetScratch sc;
+        snippetTerms(rawQuery, sc.terms);
+        for (size_t k = 0; k < ids.size(); ++k) {
+            uint32_t ord;
+            if (const Segment *seg = locate(ids[k], ord)) snippet(*seg, ord, sc.terms, out[k], sc);
+        }
+        return out;
+    }
+
+    // the terms snippets mark, from the query's (cached) plan: its tokens and
+    // their fuzzy/prefix expansions, or the leaves of a boolean query
+    void snippetTerms(const string &rawQuery, vector<pair<uint32_t,double>> &terms) const {
+        terms.clear();
+        shared_ptr<const QueryPlan> p = plan(rawQuery);
+        if (p->shape == QueryShape::Boolean) leafTerms(p->root, terms);
+        const QueryCtx &c = p->c;
+        for (size_t i = 0; i < c.qtokens.size(); ++i) {
+            if (c.qids[i] != TermDict::NONE && !isStopword(c.qids[i])) terms.push_back({c.qids[i], idf(c.qids[i])});
+            for (uint32_t id : c.fuzzy[i]) if (!isStopword(id)) terms.push_back({id, 0.5 * idf(id)});
+        }
+        sort(terms.begin(), terms.end(), [](const pair<uint32_t,double> &a, const pair<uint32_t,double> &b) {
+            return a.first != b.first ? a.first < b.first : a.second > b.second;
+        });
+        terms.erase(unique(terms.begin(), terms.end(), [](const pair<uint32_t,double> &a, const pair<uint32_t,double> &b) {
+            return a.first == b.first;
+        }), terms.end());
+    }
+
+    void leafTerms(const BoolNode &n, vector<pair<uint32_t,double>> &terms) const {
+        if (n.kind == BoolNode::NOT) return;
+        for (auto &t : n.tokens) {
+            uint32_t id = dict.find(t);
+            if (id != TermDict::NONE && !isStopword(id)) terms.push_back({id, idf(id)});
+        }
+        for (auto &k : n.kids) leafTerms(k, terms);
+    }
+
+    void snippet(const Segment &s, uint32_t ord, const vector<pair<uint32_t,double>> &terms, Snippet &out, SnippetScratch &sc) const {
+        Doc d = s.docs[ord];
+        uint32_t bodyLen = d.seq.size() - d.titleLen;
+        out.text.clear();
+        out.marks.clear();
+        if (bodyLen == 0 || d.offsets.empty()) return;
+
+        // body positions of the query terms in this doc, as (position, term index)
+        auto &hits = sc.hits;
+        hits.clear();
+        for (uint32_t t = 0; t < terms.size(); ++t) {
+            if (!binary_search(d.vecTerms.begin(), d.vecTerms.end(), terms[t].first)) continue;
+            const PostingList *pl = s.listOf(terms[t].first);
+            if (!pl) continue;
+            PostingCursor &cur = sc.cur;
+            cur.reset(s.postings, *pl);
+            cur.advance(ord);
+            if (cur.doc() != ord) continue;
+            uint32_t n;
+            const uint32_t *pos = cur.positions(n);
+            for (uint32_t i = 0; i < n; ++i) if (pos[i] >= d.titleLen) hits.push_back({pos[i] - d.titleLen, t});
+        }
+        sort(hits.begin(), hits.end());
+
+        // best window: distinct terms by weight, repeats as a tie-breaker
+        uint32_t start = 0;
+        if (!hits.empty()) {
+            auto &inWindow = sc.inWindow;
+            inWindow.assign(terms.size(), 0);
+            double score = 0, best = -1;
+            for (size_t lo = 0, hi = 0; hi < hits.size(); ++hi) {
+                if (inWindow[hits[hi].second]++ == 0) score += terms[hits[hi].second].second;
+                score += 1e-3;
+                while (hits[hi].first - hits[lo].first >= (uint32_t)kSnippetTokens) {
+                    if (--inWindow[hits[lo].second] == 0) score -= terms[hits[lo].second].second;
+                    score -= 1e-3;
+                    lo++;
+                }
+                if (score > best + 1e-9) { best = score; start = hits[lo].first; }
+            }
+            // a little context before the first match
+            start = start > 3 ? start - 3 : 0;
+        }
+        uint32_t end = min(bodyLen, start + kSnippetTokens);
+        if (end - start < (uint32_t)kSnippetTokens) start = end > (uint32_t)kSnippetTokens ? end - kSnippetTokens : 0;
+
+        // walk the content from the checkpoint before start, token by token
+        string_view text = d.content;
+        auto word = [](unsigned char ch) { return (unsigned)((ch | 0x20) - 'a') < 26 || (unsigned)(ch - '0') < 10; };
+        uint32_t tok = start / kOffsetStride * kOffsetStride;
+        size_t at = d.offsets[tok / kOffsetStride], from = 0, to = 0;
+        uint32_t last = start; // last token taken
+        auto hit = lower_bound(hits.begin(), hits.end(), make_pair(start, 0u));
+        auto &marks = sc.marks; // byte ranges in the content
+        marks.clear();
+        for (; tok < end && at < text.size(); ++tok) {
+            size_t b = at;
+            while (at < text.size() && word(text[at])) at++;
+            if (tok == start) from = b;
+            if (tok >= start) {
+                to = at;
+                last = tok;
+                if (hit != hits.end() && hit->first == tok) marks.push_back({b, at - b});
+                while (hit != hits.end() && hit->first == tok) ++hit;
+                if (to - from >= kSnippetBytes) break;
+            }
+            while (at < text.size() && !word(text[at])) at++;
+        }
+        // closing punctuation of the last token, as in "C++." or "(DSA)"
+        while (to < text.size() && to < at && text[to] != ' ' && text[to] != '\n' && to - from < kSnippetBytes) to++;
+
+        if (start > 0) out.text = "...";
+        size_t shift = out.text.size();
+        out.text.append(text.substr(from, to - from));
+        if (last + 1 < bodyLen) out.text += "...";
+        for (auto &m : marks) if (m.first + m.second <= to) out.marks.push_back({m.first - from + shift, m.second});
+    }
+
+    // the segment holding the live doc with this id, and its ordinal there
+    const Segment *locate(int id, uint32_t &ord) const {
+        for (auto &seg : segs) if ((ord = seg->findLive(id)) != DocTable::NONE) return seg.get();
+        return nullptr;
+    }
+
+    // the live doc with this id; the view keeps its segment alive
+    optional<Doc> getDocById(int id) const {
+        for (auto &seg : segs) {
+            uint32_t ord = seg->findLive(id);
+            if (ord == DocTable::NONE) continue;
+            Doc d = seg->docs[ord];
+            d.keep = seg;
+            return d;
+        }
+        return nullopt;
+    }
+};
+
+// -------------------- Search engine --------------------
+// Writer side of an LSM-style index. Added and deleted docs are buffered and
+// become visible at the next refresh(), which tokenizes them into a new small
+// segment and records deleted or replaced docs as tombstones in the older
+// segments. A merge policy compacts runs of similar-sized segments, dropping
+// the deleted docs. Searches run on the last published snapshot, so neither
+// ingestion nor merging blocks them; with setRefreshInterval() refreshes and
+// merges run on background threads.
+const size_t kMergeFactor = 8; // segments of one size tier merged at a time
+const double kMaxBoundSlack = 1.25; // block bounds are computed again once they would be this much wider
+
+class SearchEngine {
+private:
+    struct PendingDoc {
+        DocRecord rec;
+        bool analyzed = false;  // term ids already interned (addSegment)
+        bool dead = false;      // replaced or deleted before the refresh
+    };
+
+    // state the next snapshot is built from, guarded by indexMu
+    mutable mutex indexMu;
+    TermDict dict;                 // term <-> term id
+    uint32_t frozenSize = 0;       // dict size at the last freeze()
+    Column<char> stopword;         // term id -> is a stopword
+    vector<shared_ptr<const Segment>> segs;
+    Column<uint32_t> termDf;
+    Column<double> termIdf;        // term id -> idf at the last publish()
+    double avgTitleLen = 0, avgBodyLen = 0; // tokens per doc at the last publish()
+    uint64_t nextUid = 1;
+    int fuzzyDistance = 1;         // max edit distance for fuzzy term expansion
+    Ranker ranker = Ranker::Classic;
+    int denseProbes = 0;           // see setDenseProbes()
+    string spillPrefix;            // see setSpill(), empty: segments stay on the heap
+    size_t maxMergeBytes = SIZE_MAX;
+    size_t spillSeq = 0;           // segment files written
+    string spillErr;               // why the last spill failed
+
+    // writes since the last refresh, guarded by bufMu (taken after indexMu)
+    mutex bufMu;
+    vector<PendingDoc> pending;
+    unordered_map<int, size_t> pendingPos; // id -> latest entry in pending
+    vector<int> pendingDeletes;
+
+    // Published with atomic_store and read with atomic_load, RCU style:
+    // readers never block, and a replaced snapshot is freed by whichever
+    // query drops the last reference to it.
+    shared_ptr<const IndexSnapshot> current;
+
+    // background refresh and merge
+    mutex bgMu;
+    condition_variable bgCv;
+    bool stopping = false, mergeWanted = false;
+    atomic<int> refreshMs{0};
+    thread refresher, merger;
+
+    int threads = max(1u, thread::hardware_concurrency());
+    mutex poolMu;
+    shared_ptr<ThreadPool> pool;   // shared with the snapshots for query sharding
+    int queryShards = 1;
+
+    // query caches shared by the snapshots, null when disabled
+    shared_ptr<LruCache<vector<pair<int,double>>>> resultCache =
+        make_shared<LruCache<vector<pair<int,double>>>>(16 << 20);
+    shared_ptr<LruCache<vector<int>>> phraseCache = make_shared<LruCache<vector<int>>>(32 << 20);
+    shared_ptr<LruCache<shared_ptr<const IndexSnapshot::QueryPlan>>> planCache =
+        make_shared<LruCache<shared_ptr<const IndexSnapshot::QueryPlan>>>(4 << 20);
+    bool queryPlans = true;        // see setQueryPlans()
+    uint64_t generation = 0;
+    shared_ptr<QueryMetrics> metrics = make_shared<QueryMetrics>(); // outlives every snapshot
+
+    shared_ptr<ThreadPool> sharedWorkers() {
+        lock_guard<mutex> lock(poolMu);
+        if (!pool) pool = make_shared<ThreadPool>(threads - 1); // the caller is the last worker
+        return pool;
+    }
+
+    ThreadPool &workers() { return *sharedWorkers(); }
+
+    // split [0, n) into about one range per thread
+    vector<pair<int,int>> shardRanges(int n) const {
+        vector<pair<int,int>> r;
+        int shards = max(1, min(threads, n));
+        for (int s = 0; s < shards; ++s) r.push_back({(int)((long)n * s / shards), (int)((long)n * (s + 1) / shards)});
+        return r;
+    }
+
+    void buildStopwords() {
+        const string arr[] = {"the","is","at","which","on","and","a","an","of","in","to","for","with","that","this","it","by","as","from"};
+        for (auto &w : arr) {
+            uint32_t id = dict.intern(w);
+            if (id >= stopword.size()) stopword.resize(id + 1);
+            stopword.w(id) = 1;
+        }
+    }
+
+    bool isStopword(uint32_t id) const { return id < stopword.size() && stopword[id]; }
+
+    // Tokenize docs on the pool. Each shard interns into its own local
+    // dictionary; the shards are then merged into the global one in doc
+    // order, so term ids come out exactly as a serial build would assign them.
+    void analyze(const vector<DocRecord*> &recs) {
+        auto ranges = shardRanges(recs.size());
+        struct Shard {
+            TermDict local;             // local ids in first-seen order
+            vector<uint32_t> titleLen;  // per doc: tokens that come from the title
+            vector<uint32_t> map;       // local id -> global id
+        };
+        vector<Shard> shards(ranges.size());
+        workers().parallelFor(ranges.size(), [&](int s) {
+            Shard &sh = shards[s];
+            Tokenizer tok;
+            for (int i = ranges[s].first; i < ranges[s].second; ++i) {
+                DocRecord &d = *recs[i];
+                d.seq.clear();
+                for (string_view t : tok(d.title)) d.seq.push_back(sh.local.intern(t));
+                sh.titleLen.push_back(d.seq.size());
+                d.offsets.clear();
+                uint32_t k = 0;
+                for (string_view t : tok(d.content)) {
+                    if (k++ % kOffsetStride == 0) d.offsets.push_back(tok.offsetOf(t));
+                    d.seq.push_back(sh.local.intern(t));
+                }
+            }
+        });
+        for (auto &sh : shards) {
+            for (uint32_t id = 0; id < sh.local.size(); ++id) sh.map.push_back(dict.intern(sh.local.term(id)));
+        }
+        workers().parallelFor(ranges.size(), [&](int s) {
+            Shard &sh = shards[s];
+            for (int i = ranges[s].first, k = 0; i < ranges[s].second; ++i, ++k) {
+                DocRecord &d = *recs[i];
+                for (auto &id : d.seq) id = sh.map[id];
+                analyzeDoc(d, sh.titleLen[k]);
+            }
+        });
+    }
+
+    // Derive the term vector, title terms, acronym and length factor of a doc
+    // whose seq holds global term ids; the first titleLen tokens are the title.
+    void analyzeDoc(DocRecord &d, size_t titleLen) {
+        vector<uint32_t> ids;
+        for (uint32_t id : d.seq) if (!isStopword(id)) ids.push_back(id);
+        sort(ids.begin(), ids.end());
+        d.vecTerms.clear();
+        d.vecFreq.clear();
+        d.vecTf.clear();
+        for (size_t i = 0; i < ids.size(); ) {
+            size_t j = i;
+            while (j < ids.size() && ids[j] == ids[i]) j++;
+            d.vecTerms.push_back(ids[i]);
+            d.vecFreq.push_back(j - i);
+            d.vecTf.push_back((float)(1 + log(j - i)));
+            i = j;
+        }
+
+        // shortform created from the first letter of each title word
+        d.acronym.clear();
+        d.titleLen = titleLen;
+        d.titleTerms.assign(d.seq.begin(), d.seq.begin() + titleLen);
+        for (uint32_t id : d.titleTerms) d.acronym.push_back(dict.term(id)[0]);
+        sort(d.titleTerms.begin(), d.titleTerms.end());
+        d.titleTerms.erase(unique(d.titleTerms.begin(), d.titleTerms.end()), d.titleTerms.end());
+        // shorter doc that matches exactly might be more relevant
+        int totalTok = d.seq.size() ? (int)d.seq.size() : 1;
+        d.lenFactor = 1.0 / sqrt(totalTok / 50.0 + 1.0); // heuristic
+    }
+
+    // Invert analyzed docs (term ids < V) into a segment; norms and block
+    // bounds are left to rescore(). Docs are split into contiguous shards,
+    // each shard inverts its range into partial postings, and the partial
+    // lists of a term are merged in shard (= docID) order while term ranges
+    // are encoded in parallel. The output is identical to a single-threaded build.
+    shared_ptr<Segment> invert(DocTable docs, uint32_t V, const Column<char> &stop) {
+        auto seg = make_shared<Segment>();
+        int n = docs.size();
+
+        // 1) per-shard inversion into CSR arrays keyed by term id
+        struct Partial {
+            vector<uint32_t> start;          // term id -> first posting, size V+1
+            vector<pair<int,int>> postings;  // (doc ordinal, freq) grouped by term
+            vector<uint32_t> posStart;       // term id -> first position, size V+1
+            vector<uint32_t> positions;
+        };
+        auto ranges = shardRanges(n);
+        vector<Partial> parts(ranges.size());
+        workers().parallelFor(ranges.size(), [&](int s) {
+            Partial &pt = parts[s];
+            pt.start.assign(V + 1, 0);
+            pt.posStart.assign(V + 1, 0);
+            for (int i = ranges[s].first; i < ranges[s].second; ++i) {
+                const Doc &d = docs[i];
+                for (size_t k = 0; k < d.vecTerms.size(); ++k) {
+                    pt.start[d.vecTerms[k] + 1]++;
+                    pt.posStart[d.vecTerms[k] + 1] += d.vecFreq[k];
+                }
+            }
+            for (uint32_t t = 0; t < V; ++t) {
+                pt.start[t + 1] += pt.start[t];
+                pt.posStart[t + 1] += pt.posStart[t];
+            }
+            pt.postings.resize(pt.start[V]);
+            pt.positions.resize(pt.posStart[V]);
+            vector<uint32_t> fill(pt.start.begin(), pt.start.end() - 1), posFill(pt.posStart.begin(), pt.posStart.end() - 1);
+            for (int i = ranges[s].first; i < ranges[s].second; ++i) {
+                const Doc &d = docs[i];
+                for (size_t k = 0; k < d.vecTerms.size(); ++k) pt.postings[fill[d.vecTerms[k]]++] = {i, (int)d.vecFreq[k]};
+                for (size_t p = 0; p < d.seq.size(); ++p) {
+                    uint32_t id = d.seq[p];
+                    if (!(id < stop.size() && stop[id])) pt.positions[posFill[id]++] = p;
+                }
+            }
+        });
+
+        // 2) merge the partial lists of each term and encode, one term range per task
+        vector<uint32_t> titleLens(n);
+        for (int i = 0; i < n; ++i) titleLens[i] = docs.titleLenOf(i);
+        auto termRanges = shardRanges(V);
+        vector<PostingIndex> chunks(termRanges.size());
+        vector<vector<pair<uint32_t,PostingList>>> chunkLists(termRanges.size());
+        workers().parallelFor(termRanges.size(), [&](int r) {
+            vector<pair<int,int>> list;
+            vector<uint32_t> pos;
+            for (int t = termRanges[r].first; t < termRanges[r].second; ++t) {
+                list.clear();
+                pos.clear();
+                for (auto &pt : parts) { // shards cover increasing doc ranges
+                    list.insert(list.end(), pt.postings.begin() + pt.start[t], pt.postings.begin() + pt.start[t + 1]);
+                    pos.insert(pos.end(), pt.positions.begin() + pt.posStart[t], pt.positions.begin() + pt.posStart[t + 1]);
+                }
+                if (!list.empty()) chunkLists[r].push_back({(uint32_t)t, chunks[r].add(list, &pos, titleLens.data())});
+            }
+        });
+        parts.clear();
+        vector<uint32_t> terms;
+        vector<PostingList> lists;
+        for (size_t r = 0; r < chunks.size(); ++r) {
+            uint32_t shift = seg->postings.append(chunks[r]);
+            for (auto &tl : chunkLists[r]) {
+                tl.second.firstBlock += shift;
+                terms.push_back(tl.first);
+                lists.push_back(tl.second);
+            }
+        }
+        seg->terms.assign(move(terms));
+        seg->lists.assign(move(lists));
+        seg->docs = move(docs);
+        seg->acronyms.build(seg->docs);
+        for (uint32_t i = 0; i < seg->size(); ++i) {
+            const Doc &d = seg->docs[i];
+            seg->titleTokens += d.titleLen;
+            seg->bodyTokens += d.seq.size() - d.titleLen;
+        }
+        return seg;
+    }
+
+    // Doc norms and block bounds of a segment for the given idfs and average
+    // field lengths, which are recorded with them
+    void rescore(Segment &s, const Column<double> &idf, double avgTitle, double avgBody) {
+        auto ranges = shardRanges(s.size());
+        vector<double> norms(s.size());
+        vector<float> fieldNorms(2 * s.size());
+        workers().parallelFor(ranges.size(), [&](int r) {
+            for (int i = ranges[r].first; i < ranges[r].second; ++i) {
+                norms[i] = IndexSnapshot::normOf(s.docs[i], idf.data());
+                fieldNorms[2 * i] = Bm25f::titleNorm(s.docs.titleLenOf(i), avgTitle);
+                fieldNorms[2 * i + 1] = Bm25f::bodyNorm(s.docs.bodyLen(i), avgBody);
+            }
+        });
+        // per-block score bounds for WAND; rounded up so float storage never underestimates
+        const double up = 1 + 1e-6;
+        vector<PostingList> lists(s.lists.begin(), s.lists.end());
+        s.postings.resetBounds();
+        auto listRanges = shardRanges(lists.size());
+        workers().parallelFor(listRanges.size(), [&](int r) {
+            for (int k = listRanges[r].first; k < listRanges[r].second; ++k) {
+                s.postings.computeBounds(lists[k], [&](uint32_t ord, uint32_t freq, uint32_t titleFreq, BlockBound &b) {
+                    const Doc &d = s.docs[ord];
+                    double tfLen = (1 + log(freq)) * d.lenFactor;
+                    b.tfLen = max(b.tfLen, (float)(tfLen * up));
+                    if (norms[ord] > 0) b.tfLenNorm = max(b.tfLenNorm, (float)(tfLen / norms[ord] * up));
+                    b.len = max(b.len, (float)(d.lenFactor * up));
+                    float sat = Bm25f::saturate(freq, titleFreq, fieldNorms[2 * ord], fieldNorms[2 * ord + 1]);
+                    b.bm25 = max(b.bm25, (float)(sat * up));
+                });
+            }
+        });
+        s.lists.assign(move(lists));
+        vector<double> at(s.terms.size());
+        for (size_t k = 0; k < at.size(); ++k) at[k] = idf[s.terms[k]];
+        s.boundIdf.assign(move(at));
+        s.boundLens.assign(vector<double>{avgTitle, avgBody});
+        s.norms.assign(move(norms));
+        s.fieldNorms.assign(move(fieldNorms));
+        s.normsExact = s.fieldNormsExact = true;
+        s.normSlack = s.fieldSlack = 1.0;
+    }
+
+    // Slacks that keep the bounds of a segment valid for the given stats:
+    // a doc norm shrinks by at most the largest relative idf drop among the
+    // segment's terms, and a saturated tf grows by at most the growth of an
+    // average field length. False if the bounds are missing or would be
+    // widened past kMaxBoundSlack; they are computed again then. exact and
+    // fieldsExact tell whether the stored tf-idf and BM25F doc norms still hold.
+    static bool slacks(const Segment &s, const Column<double> &idf, double avgTitle, double avgBody,
+                       double &normSlack, double &fieldSlack, bool &exact, bool &fieldsExact) {
+        if (s.boundIdf.size() != s.terms.size() || s.boundLens.size() != 2) return false;
+        double shrink = 1.0;
+        exact = true;
+        for (size_t k = 0; k < s.terms.size(); ++k) {
+            double now = idf[s.terms[k]];
+            exact &= now == s.boundIdf[k];
+            if (s.boundIdf[k] > 0) shrink = min(shrink, now / s.boundIdf[k]);
+        }
+        auto growth = [](double now, double then) { return now <= then ? 1.0 : then > 0 ? now / then : HUGE_VAL; };
+        normSlack = shrink > 0 ? 1 / shrink : HUGE_VAL;
+        fieldSlack = max(growth(avgTitle, s.boundLens[0]), growth(avgBody, s.boundLens[1]));
+        fieldsExact = avgTitle == s.boundLens[0] && avgBody == s.boundLens[1];
+        return normSlack <= kMaxBoundSlack && fieldSlack <= kMaxBoundSlack;
+    }
+
+    // Write a scored segment to a file and use it from the mapping: the file
+    // is unlinked at once and its pages stay with the mapping, so they can be
+    // evicted and read back like any mapped index. The heap segment is kept
+    // if the write fails.
+    shared_ptr<const Segment> spill(const shared_ptr<const Segment> &seg) {
+        string path = spillPrefix + "." + to_string(spillSeq++) + ".seg", err;
+        SegmentWriter w;
+        seg->save(w);
+        SegmentReader r;
+        auto mapped = make_shared<Segment>();
+        bool ok = w.write(path, err) && r.open(path, false, err) && mapped->map(r, err);
+        remove(path.c_str());
+        if (!ok) { spillErr = err; return seg; }
+        mapped->uid = seg->uid;
+        mapped->normSlack = seg->normSlack;
+        mapped->fieldSlack = seg->fieldSlack;
+        mapped->normsExact = seg->normsExact;
+        mapped->fieldNormsExact = seg->fieldNormsExact;
+        mapped->deleted = seg->deleted;
+        mapped->numDeleted = seg->numDeleted;
+        mapped->spilled = true;
+        return mapped;
+    }
+
+    // Swap in a new snapshot of the current segments. Before that:
+    //  - fully deleted segments are dropped, and the dfs, idfs, N and
+    //    average field lengths are summed again over the others, deleted
+    //    docs included until a merge removes them;
+    //  - when those stats moved, each segment gets the slacks that keep its
+    //    block bounds valid and learns whether its stored tf-idf and BM25F
+    //    doc norms still hold (slacks()); a segment whose slacks would pass
+    //    kMaxBoundSlack, or that was never scored, has its norms and bounds
+    //    computed again (rescore());
+    //  - embeddings are built for segments rescored or lacking them, or
+    //    dropped when dense retrieval is off;
+    //  - segments are spilled if setSpill() asked for it, and the sorted
+    //    term dictionary is rebuilt if terms were added.
+    // Only segments that change are copied; the others are shared with the
+    // previous snapshot.
+    void publish() {
+        segs.erase(remove_if(segs.begin(), segs.end(), [](const shared_ptr<const Segment> &s) { return s->live() == 0; }), segs.end());
+        uint32_t V = dict.size();
+        vector<uint32_t> df(V, 0);
+        int n = 0;
+        uint64_t titleTokens = 0, bodyTokens = 0;
+        for (auto &s : segs) {
+            n += s->size();
+            titleTokens += s->titleTokens;
+            bodyTokens += s->bodyTokens;
+            for (size_t k = 0; k < s->terms.size(); ++k) df[s->terms[k]] += s->lists[k].df;
+        }
+        vector<double> idf(V, 0.0);
+        for (uint32_t t = 0; t < V; ++t) {
+            if (df[t]) idf[t] = log((double)n / (double)df[t]);
+        }
+        double avgTitle = n ? (double)titleTokens / n : 0.0, avgBody = n ? (double)bodyTokens / n : 0.0;
+        bool moved = idf.size() != termIdf.size() || !equal(idf.begin(), idf.end(), termIdf.begin()) ||
+                     avgTitle != avgTitleLen || avgBody != avgBodyLen;
+        if (moved) {
+            termIdf.assign(move(idf));
+            avgTitleLen = avgTitle;
+            avgBodyLen = avgBody;
+        }
+        termDf.assign(move(df));
+        for (auto &s : segs) {
+            double normSlack = s->normSlack, fieldSlack = s->fieldSlack;
+            bool exact = s->normsExact, fieldsExact = s->fieldNormsExact;
+            bool stale = s->boundLens.empty(); // never computed
+            if (moved || stale) stale = !slacks(*s, termIdf, avgTitleLen, avgBodyLen, normSlack, fieldSlack, exact, fieldsExact);
+            bool widen = !stale && (normSlack != s->normSlack || fieldSlack != s->fieldSlack || exact != s->normsExact ||
+                                    fieldsExact != s->fieldNormsExact);
+            if (!stale && !widen && (denseProbes == 0 || s->dense.size() == s->size())) continue;
+            auto copy = make_shared<Segment>(*s);
+            if (stale) rescore(*copy, termIdf, avgTitleLen, avgBodyLen);
+            else {
+                copy->normSlack = normSlack;
+                copy->fieldSlack = fieldSlack;
+                copy->normsExact = exact;
+                copy->fieldNormsExact = fieldsExact;
+            }
+            // embeddings are tf-idf projections, refreshed with the bounds
+            if (denseProbes == 0) copy->dense = DenseIndex();
+            else if (stale || copy->dense.size() != copy->size()) copy->dense.build(copy->docs, termIdf, workers());
+            s = copy;
+        }
+        if (!spillPrefix.empty()) {
+            for (auto &s : segs) if (!s->spilled) s = spill(s);
+        }
+        if (frozenSize != V) { dict.freeze(); frozenSize = V; }
+
+        auto snap = make_shared<IndexSnapshot>();
+        snap->dict = dict;
+        snap->termDf = termDf;
+        snap->termIdf = termIdf;
+        snap->stopword = stopword;
+        snap->segs = segs;
+        snap->N = n;
+        snap->avgTitleLen = avgTitleLen;
+        snap->avgBodyLen = avgBodyLen;
+        snap->fuzzyDistance = fuzzyDistance;
+        snap->ranker = ranker;
+        snap->shards = queryShards;
+        snap->denseProbes = denseProbes;
+        if (queryShards > 1) snap->pool = sharedWorkers();
+        snap->generation = ++generation;
+        snap->resultCache = resultCache;
+        snap->phraseCache = phraseCache;
+        snap->planCache = planCache;
+        snap->plans = queryPlans;
+        snap->metrics = metrics;
+        atomic_store(&current, shared_ptr<const IndexSnapshot>(snap));
+    }
+
+    static int tierOf(uint32_t docs) {
+        int t = 0;
+        for (; docs >= kMergeFactor; docs /= kMergeFactor) t++;
+        return t;
+    }
+
+    // Adjacent run of segments to merge next: kMergeFactor segments of one
+    // size tier, or a single segment that is mostly deleted. Empty if none.
+    // Runs holding more than maxMergeBytes of docs are left alone.
+    pair<size_t,size_t> pickMerge() const {
+        for (size_t i = 0; i < segs.size(); ++i) {
+            if (segs[i]->numDeleted * 2 > segs[i]->size() && segs[i]->docs.byteSize() <= maxMergeBytes) return {i, i + 1};
+            size_t j = i;
+            while (j < segs.size() && tierOf(segs[j]->live()) == tierOf(segs[i]->live())) j++;
+            if (j - i < kMergeFactor) continue;
+            size_t bytes = 0;
+            for (size_t k = i; k < i + kMergeFactor; ++k) bytes += segs[k]->docs.byteSize();
+            if (bytes <= maxMergeBytes) return {i, i + kMergeFactor};
+        }
+        return {0, 0};
+    }
+
+    // Merge one run chosen by pickMerge(), or every segment if all is set;
+    // false when there is nothing to merge. The merged segment is built from
+    // the stored doc vectors without holding indexMu, and docs deleted in the
+    // meantime are carried over as tombstones.
+    bool mergeOnce(bool all = false) {
+        vector<shared_ptr<const Segment>> in;
+        uint32_t V;
+        Column<char> stop;
+        {
+            lock_guard<mutex> lock(indexMu);
+            pair<size_t,size_t> run = all ? make_pair((size_t)0, segs.size()) : pickMerge();
+            size_t len = run.second - run.first;
+            if (len == 0 || (len == 1 && segs[run.first]->numDeleted == 0)) return false;
+            in.assign(segs.begin() + run.first, segs.begin() + run.second);
+            V = dict.size();
+            stop = stopword;
+        }
+        DocTable table;
+        for (auto &s : in) {
+            for (uint32_t i = 0; i < s->size(); ++i) if (!s->isDeleted(i)) table.append(s->docs[i]);
+        }
+        auto merged = invert(move(table), V, stop);
+
+        lock_guard<mutex> lock(indexMu);
+        merged->uid = nextUid++;
+        size_t at = segs.size();
+        uint32_t ord = 0;
+        for (auto &s : in) {
+            auto it = find_if(segs.begin(), segs.end(), [&](const shared_ptr<const Segment> &x) { return x->uid == s->uid; });
+            const Segment *now = it == segs.end() ? nullptr : it->get(); // gone once fully deleted
+            for (uint32_t i = 0; i < s->size(); ++i) {
+                if (s->isDeleted(i)) continue;
+                if (!now || now->isDeleted(i)) merged->markDeleted(ord);
+                ord++;
+            }
+            if (it != segs.end()) {
+                at = min(at, (size_t)(it - segs.begin()));
+                segs.erase(it);
+            }
+        }
+        segs.insert(segs.begin() + min(at, segs.size()), merged);
+        publish();
+        return true;
+    }
+
+    void stopBackground() {
+        {
+            lock_guard<mutex> lock(bgMu);
+            stopping = true;
+        }
+        bgCv.notify_all();
+        if (refresher.joinable()) refresher.join();
+        if (merger.joinable()) merger.join();
+        stopping = false;
+    }
+
+public:
+    SearchEngine() {
+        buildStopwords();
+        lock_guard<mutex> lock(indexMu);
+        publish();
+    }
+
+    ~SearchEngine() { stopBackground(); }
+
+    SearchEngine(const SearchEngine &) = delete;
+    SearchEngine &operator=(const SearchEngine &) = delete;
+
+    // the last published index; holding it keeps it valid across refreshes
+    shared_ptr<const IndexSnapshot> snapshot() const { return atomic_load(&current); }
+
+    // Split every query into about n doc-range shards scored in parallel on
+    // the indexing threads (1: serial). Results do not depend on n.
+    void setQueryShards(int n) {
+        lock_guard<mutex> lock(indexMu);
+        queryShards = max(1, n);
+        publish();
+    }
+
+    // Byte budgets of the query result cache, the phrase match cache and
+    // the query plan cache (0 turns a cache off). Results and plans are
+    // dropped on every publish; phrase matches belong to a segment and live
+    // as long as it is not merged away.
+    void setCacheBudget(size_t resultBytes, size_t phraseBytes, size_t planBytes) {
+        lock_guard<mutex> lock(indexMu);
+        resultCache = resultBytes ? make_shared<LruCache<vector<pair<int,double>>>>(resultBytes) : nullptr;
+        phraseCache = phraseBytes ? make_shared<LruCache<vector<int>>>(phraseBytes) : nullptr;
+        planCache = planBytes ? make_shared<LruCache<shared_ptr<const IndexSnapshot::QueryPlan>>>(planBytes) : nullptr;
+        publish();
+    }
+
+    pair<CacheStats, CacheStats> cacheStats() const {
+        lock_guard<mutex> lock(indexMu);
+        return {resultCache ? resultCache->stats() : CacheStats(), phraseCache ? phraseCache->stats() : CacheStats()};
+    }
+
+    CacheStats planCacheStats() const {
+        lock_guard<mutex> lock(indexMu);
+        return planCache ? planCache->stats() : CacheStats();
+    }
+
+    // Run queries through plans (the default): each query is classified once
+    // and evaluated by code specialized for its shape, and its plan is kept
+    // for repeats. Off, every query is parsed again and runs the generic
+    // evaluator; results are the same either way.
+    void setQueryPlans(bool on) {
+        lock_guard<mutex> lock(indexMu);
+        queryPlans = on;
+        publish();
+    }
+
+    IndexSnapshot::QueryShape queryShape(const string &rawQuery) const { return snapshot()->shapeOf(rawQuery); }
+
+    void setRanker(Ranker r) {
+        lock_guard<mutex> lock(indexMu);
+        ranker = r;
+        publish();
+    }
+
+    // Dense retrieval: long queries are scored on the docs nearest to their
+    // embedding, found by probing n IVF lists per segment (0: off, the
+    // default). More probes give higher recall at a proportional cost.
+    // Turning it on embeds and clusters every segment.
+    void setDenseProbes(int n) {
+        lock_guard<mutex> lock(indexMu);
+        denseProbes = max(0, n);
+        publish();
+    }
+
+    vector<pair<int,double>> denseSearch(const string &rawQuery, int topK, int probes) const {
+        return snapshot()->denseSearch(rawQuery, topK, probes);
+    }
+
+    void setFuzzyDistance(int k) {
+        lock_guard<mutex> lock(indexMu);
+        fuzzyDistance = max(0, k);
+        publish();
+    }
+
+    vector<uint32_t> fuzzyExpand(const string &token) const { return snapshot()->fuzzyExpand(token); }
+    vector<pair<string,uint32_t>> complete(const string &prefix, size_t limit = 10) const { return snapshot()->complete(prefix, limit); }
+    double idf(uint32_t id) const { return snapshot()->idf(id); }
+
+    // Keep segments on disk: every segment a refresh or merge builds is
+    // written to <prefix>.<n>.seg once scored and used from the mapping, so
+    // the heap holds the buffered docs and the merge in progress rather than
+    // the index. Merges of runs with more than maxMergeBytes of stored docs
+    // are not started. An empty prefix keeps new segments on the heap.
+    void setSpill(const string &prefix, size_t maxMergeBytes) {
+        lock_guard<mutex> lock(indexMu);
+        spillPrefix = prefix;
+        this->maxMergeBytes = prefix.empty() ? SIZE_MAX : maxMergeBytes;
+        spillErr.clear();
+        publish();
+    }
+
+    // why the last segment could not be spilled, empty if none failed
+    string spillError() const {
+        lock_guard<mutex> lock(indexMu);
+        return spillErr;
+    }
+
+    // number of threads used for indexing and query shards; set it before adding docs
+    void setThreads(int n) {
+        lock_guard<mutex> lock(poolMu);
+        threads = max(1, n);
+        pool.reset();
+    }
+
+    // Refresh every ms milliseconds and merge on a background thread
+    // (0: only on refresh(), merging inline).
+    void setRefreshInterval(int ms) {
+        stopBackground();
+        refreshMs = max(0, ms);
+        if (refreshMs == 0) return;
+        refresher = thread([this]{
+            unique_lock<mutex> lock(bgMu);
+            while (!bgCv.wait_for(lock, chrono::milliseconds(refreshMs.load()), [&]{ return stopping; })) {
+                lock.unlock();
+                refresh();
+                lock.lock();
+            }
+        });
+        merger = thread([this]{
+            unique_lock<mutex> lock(bgMu);
+            while (true) {
+                bgCv.wait(lock, [&]{ return stopping || mergeWanted; });
+                if (stopping) break;
+                mergeWanted = false;
+                lock.unlock();
+                while (mergeOnce()) {}
+                lock.lock();
+            }
+        });
+    }
+
+    // Buffered until the next refresh(); a doc with the id of an existing one replaces it.
+    void addDoc(int id, const string &title, const string &content, const string &link) {
+        PendingDoc p;
+        p.rec.id = id;
+        p.rec.title = title;
+        p.rec.content = content;
+        p.rec.link = link;
+        lock_guard<mutex> lock(bufMu);
+        auto it = pendingPos.find(id);
+        if (it != pendingPos.end()) pending[it->second].dead = true;
+        pendingPos[id] = pending.size();
+        pending.push_back(move(p));
+    }
+
+    // Buffered until the next refresh()
+    void deleteDoc(int id) {
+        lock_guard<mutex> lock(bufMu);
+        auto it = pendingPos.find(id);
+        if (it != pendingPos.end()) {
+            pending[it->second].dead = true;
+            pendingPos.erase(it);
+        }
+        pendingDeletes.push_back(id);
+    }
+
+    // Make all buffered writes searchable: the added docs become a new
+    // segment, deleted and replaced docs are tombstoned, and a new snapshot is
+    // published. Without a background merger, due merges run here too.
+    void refresh() {
+        {
+            lock_guard<mutex> lock(indexMu);
+            vector<PendingDoc> docsIn;
+            vector<int> deletes;
+            {
+                lock_guard<mutex> buf(bufMu);
+                docsIn.swap(pending);
+                deletes.swap(pendingDeletes);
+                pendingPos.clear();
+            }
+            if (docsIn.empty() && deletes.empty() && termIdf.size() == dict.size()) return;
+
+            vector<DocRecord*> toAnalyze;
+            for (auto &p : docsIn) if (!p.dead && !p.analyzed) toAnalyze.push_back(&p.rec);
+            analyze(toAnalyze);
+
+            // tombstones, applied once per touched segment
+            vector<vector<uint32_t>> dead(segs.size());
+            auto kill = [&](int id) {
+                for (size_t k = 0; k < segs.size(); ++k) {
+                    uint32_t ord = segs[k]->findLive(id);
+                    if (ord != DocTable::NONE) { dead[k].push_back(ord); return; }
+                }
+            };
+            for (int id : deletes) kill(id);
+            DocTable table;
+            for (auto &p : docsIn) {
+                if (p.dead) continue;
+                kill(p.rec.id);
+                table.append(p.rec);
+            }
+            for (size_t k = 0; k < segs.size(); ++k) {
+                if (dead[k].empty()) continue;
+                auto copy = make_shared<Segment>(*segs[k]);
+                for (uint32_t ord : dead[k]) copy->markDeleted(ord);
+                segs[k] = copy;
+            }
+
+            if (table.size()) {
+                auto seg = invert(move(table), dict.size(), stopword);
+                seg->uid = nextUid++;
+                segs.push_back(seg);
+            }
+            publish();
+        }
+        if (refreshMs > 0) {
+            lock_guard<mutex> lock(bgMu);
+            mergeWanted = true;
+            bgCv.notify_all();
+        } else {
+            while (mergeOnce()) {}
+        }
+    }
+
+    // kept for the callers of the single-segment engine
+    void buildIndex() { refresh(); }
+
+    // Write the index as one segment file; buffered writes are refreshed and
+    // all segments merged first.
+    bool save(const string &path, string &err) {
+        refresh();
+        while (mergeOnce(true)) {}
+        lock_guard<mutex> lock(indexMu);
+        Segment empty;
+        const Segment &s = segs.empty() ? empty : *segs[0];
+        uint64_t meta[2] = {(uint64_t)s.size(), (uint64_t)dict.size()};
+        SegmentWriter w;
+        w.add(kSecMeta, meta, sizeof(meta));
+        dict.save(w);
+        s.save(w);
+        w.add(kSecIdf, termIdf);
+        w.add(kSecStopwords, stopword);
+        return w.write(path, err);
+    }
+
+    // Replace the contents of the engine with a segment written by save().
+    // Every array is used in place from the mapping, so this costs a few page
+    // faults rather than a rebuild; verify also checks the section checksums,
+    // which reads the whole file. Docs added later go to new segments.
+    bool open(const string &path, string &err, bool verify = false) {
+        SegmentReader r;
+        if (!r.open(path, verify, err)) return false;
+        TermDict d;
+        auto seg = make_shared<Segment>();
+        Column<uint64_t> meta;
+        Column<double> idfs;
+        Column<char> stops;
+        bool ok = r.map(kSecMeta, meta, err) && d.map(r, err) && seg->map(r, err) &&
+                  r.map(kSecIdf, idfs, err) && r.map(kSecStopwords, stops, err);
+        if (!ok) { err = path + ": " + err; return false; }
+        if (meta.size() != 2 || seg->size() != meta[0] || d.size() != meta[1] || idfs.size() != meta[1] ||
+            stops.size() > meta[1] || (!seg->terms.empty() && seg->terms.back() >= meta[1])) {
+            err = path + ": inconsistent section sizes";
+            return false;
+        }
+        lock_guard<mutex> lock(indexMu);
+        {
+            lock_guard<mutex> buf(bufMu);
+            pending.clear();
+            pendingPos.clear();
+            pendingDeletes.clear();
+        }
+        dict = move(d);
+        frozenSize = dict.size();
+        stopword = move(stops);
+        termIdf.clear(); // recomputed by publish(), the bounds carry their own stats
+        seg->uid = nextUid++;
+        segs.assign(1, seg);
+        publish();
+        return true;
+    }
 
-int levenshtein(const string &a, const string &b) {
-    int n = a.size(), m = b.size();
-    if (n == 0) return m;
-    if (m == 0) return n;
-    vector<int> prev(m+1), cur(m+1);
-    iota(prev.begin(), prev.end(), 0);
-    for (int i = 1; i <= n; ++i) {
-        cur[0] = i;
-        for (int j = 1; j <= m; ++j) {
-            int cost = (a[i-1]==b[j-1])?0:1;
-            cur[j] = min({ prev[j] + 1, cur[j-1] + 1, prev[j-1] + cost });
+    // Queue the docs of a segment written by save() without tokenizing them
+    // again: their term ids are remapped into this dictionary.
+    bool addSegment(const string &path, string &err) {
+        SearchEngine other;
+        if (!other.open(path, err)) return false;
+        auto snap = other.snapshot();
+        lock_guard<mutex> lock(indexMu);
+        vector<uint32_t> remap(snap->dict.size());
+        for (uint32_t t = 0; t < snap->dict.size(); ++t) remap[t] = dict.intern(snap->dict.term(t));
+        vector<PendingDoc> docsIn;
+        for (auto &seg : snap->segs) {
+            for (uint32_t i = 0; i < seg->size(); ++i) {
+                if (seg->isDeleted(i)) continue;
+                const Doc &d = seg->docs[i];
+                PendingDoc p;
+                p.analyzed = true;
+                DocRecord &r = p.rec;
+                r.id = d.id;
+                r.title = d.title;
+                r.content = d.content;
+                r.link = d.link;
+                r.acronym = d.acronym;
+                r.titleLen = d.titleLen;
+                r.offsets.assign(d.offsets.begin(), d.offsets.end());
+                r.lenFactor = d.lenFactor;
+                for (uint32_t id : d.seq) r.seq.push_back(remap[id]);
+                for (uint32_t id : d.titleTerms) r.titleTerms.push_back(remap[id]);
+                sort(r.titleTerms.begin(), r.titleTerms.end());
+                vector<size_t> order(d.vecTerms.size());
+                iota(order.begin(), order.end(), 0);
+                sort(order.begin(), order.end(), [&](size_t a, size_t b) { return remap[d.vecTerms[a]] < remap[d.vecTerms[b]]; });
+                for (size_t k : order) {
+                    r.vecTerms.push_back(remap[d.vecTerms[k]]);
+                    r.vecFreq.push_back(d.vecFreq[k]);
+                    r.vecTf.push_back(d.vecTf[k]);
+                }
+                docsIn.push_back(move(p));
+            }
         }
-        swap(prev, cur);
+        lock_guard<mutex> buf(bufMu);
+        for (auto &p : docsIn) {
+            auto it = pendingPos.find(p.rec.id);
+            if (it != pendingPos.end()) pending[it->second].dead = true;
+            pendingPos[p.rec.id] = pending.size();
+            pending.push_back(move(p));
+        }
+        return true;
     }
-    return prev[m];
-}
 
-// -------------------- Document & DB --------------------
-struct Doc {
-    int id;
-    string title;
-    string content;
-    string link;
-    vector<string> tokens;        // all tokens from title+content
-    unordered_map<string,int> tf; // term frequency per doc
-    string acronym;              // shortform created from title words
+    IndexSnapshot::IndexStats indexStats() const { return snapshot()->indexStats(); }
+
+    vector<pair<int,double>> search(const string &rawQuery, int topK = 10) const {
+        return snapshot()->search(rawQuery, topK);
+    }
+
+    vector<pair<int,double>> explain(const string &rawQuery, int topK, QueryProfile &p) const {
+        return snapshot()->explain(rawQuery, topK, p);
+    }
+
+    // latency histograms and work counters of every search so far
+    string metricsText() const {
+        return metrics->prometheus();
+    }
+
+    optional<Doc> getDocById(int id) const { return snapshot()->getDocById(id); }
+
+    vector<Snippet> snippets(const string &rawQuery, const vector<int> &ids) const { return snapshot()->snippets(rawQuery, ids); }
+
+    void printDocSummary(const Doc &d, const Snippet &s) const {
+        cout << "ID: " << d.id << " | Title: " << d.title << " | Link: " << d.link << "\n";
+        cout << s.render("[", "]") << "\n";
+    }
+
+    void printDocFull(const Doc &d) const {
+        cout << "\n----- " << d.title << " -----\n";
+        cout << "Link: " << d.link << "\n";
+        cout << d.content << "\n------------------------\n";
+    }
 };
 
-class SearchEngine {
+// -------------------- Query serving --------------------
+// Runs queries from any number of callers on a fixed set of workers. The
+// read path only touches an immutable snapshot, so queries need no locks and
+// throughput scales with the workers; a refresh swapping in a new snapshot
+// does not disturb queries already running on the old one.
+class QueryPool {
 private:
-    vector<Doc> docs;
-    unordered_map<string, unordered_map<int,int>> index; // token -> (docId -> freq)
-    unordered_map<string, int> docFreq;                 // token -> doc frequency (df)
-    int N = 0;
-    set<string> stopwords;
+    const SearchEngine &engine;
+    ThreadPool pool;
 
-    void buildStopwords() {
-        const string arr[] = {"the","is","at","which","on","and","a","an","of","in","to","for","with","that","this","it","by","as","from"};
-        for (auto &w : arr) stopwords.insert(w);
+public:
+    typedef vector<pair<int,double>> Results;
+
+    explicit QueryPool(const SearchEngine &e, int threads = max(1u, thread::hardware_concurrency()))
+        : engine(e), pool(max(1, threads)) {}
+
+    future<Results> submit(string query, int topK = 10) {
+        auto task = make_shared<packaged_task<Results()>>([this, query = move(query), topK] {
+            return engine.search(query, topK);
+        });
+        future<Results> f = task->get_future();
+        pool.submit([task] { (*task)(); });
+        return f;
     }
 
-    string buildAcronym(const string &text) {
-        vector<string> words = tokenize(text);
-        string a;
-        for (auto &w : words) {
-            if (!w.empty()) a.push_back(w[0]);
-        }
-        return a;
+    // Results in input order. The whole batch runs on one snapshot.
+    vector<Results> searchAll(const vector<string> &queries, int topK = 10) {
+        auto snap = engine.snapshot();
+        vector<Results> out(queries.size());
+        pool.parallelFor(queries.size(), [&](int i) { out[i] = snap->search(queries[i], topK); });
+        return out;
     }
+};
 
+// -------------------- HTTP server --------------------
+// Local HTTP/1.1 front end of the engine:
+//   GET /search?q=QUERY&offset=N&limit=N   a page of results as JSON
+//   GET /metrics                           the query metrics, Prometheus text
+// One thread runs an epoll loop over non-blocking sockets, with keep-alive
+// and pipelining. The complete requests found in one wake-up form a batch
+// that is evaluated in one pass over one snapshot: a query asked several
+// times is run once, the others in parallel on the workers, then the
+// responses go out in request order. Pages are cut from windows of kWindow
+// results, so paging through a query is served from the result cache.
+// Connections, batch slots and their buffers are recycled; a page answered
+// from the cache allocates nothing once they have grown.
+class HttpServer {
 public:
-    SearchEngine() { buildStopwords(); }
+    static constexpr int kWindow = 50;              // results evaluated per window
+    static constexpr int kMaxResults = 1000;        // deepest result served
+    static constexpr int kMaxLimit = 100;           // largest page
+    static constexpr size_t kMaxRequest = 16 << 10; // request line and headers
+    static constexpr int kIdleSeconds = 60;         // keep-alive timeout
 
-    void addDoc(int id, const string &title, const string &content, const string &link) {
-        Doc d;
-        d.id = id;
-        d.title = title;
-        d.content = content;
-        d.link = link;
+private:
+    struct Conn {
+        int fd = -1;
+        string in, out;
+        size_t sent = 0;          // bytes of out already written
+        bool closing = false;     // close once out is written
+        bool polling = false;     // out is stuck, waiting for EPOLLOUT
+        chrono::steady_clock::time_point lastActive;
+    };
+
+    // one request of a batch
+    struct Slot {
+        Conn *conn = nullptr;
+        bool keepAlive = true;
+        int status = 200;
+        const char *error = nullptr;
+        bool metrics = false;
+        string query;
+        int offset = 0, limit = 10, window = 0;
+        int same = -1;            // earlier slot with the same query and window
+        QueryProfile profile;
+        string key;
+        vector<pair<int,double>> results;
+    };
+
+    const SearchEngine &engine;
+    ThreadPool pool;
+    int listenFd = -1, epollFd = -1, wakeFd = -1;
+    int boundPort = 0;
+    atomic<bool> stopping{false};
+    vector<unique_ptr<Conn>> conns;   // by fd
+    vector<unique_ptr<Conn>> spare;   // closed, kept for their buffers
+    vector<Slot> slots;
+    size_t batch = 0;                 // slots of the current batch
+    vector<int> distinct;             // slots to evaluate
+    shared_ptr<const IndexSnapshot> snap;
+    string body;
+    IndexSnapshot::SnippetScratch scratch; // reused across responses, with snip
+    Snippet snip;
+
+    static bool equalsNoCase(string_view a, const char *b) {
+        size_t n = strlen(b);
+        if (a.size() != n) return false;
+        for (size_t i = 0; i < n; ++i) if (tolower((unsigned char)a[i]) != b[i]) return false;
+        return true;
+    }
+
+    static string_view trim(string_view s) {
+        while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+        while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+        return s;
+    }
+
+    static int hexDigit(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        c = tolower((unsigned char)c);
+        return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+    }
 
-        string combined = title + " " + content;
-        d.tokens = tokenize(combined);
-        for (auto &t : d.tokens) {
-            if (stopwords.count(t)) continue;
-            d.tf[t]++;
+    // %XX escapes and '+' for space
+    static void urlDecode(string_view s, string &out) {
+        out.clear();
+        for (size_t i = 0; i < s.size(); ++i) {
+            int hi, lo;
+            if (s[i] == '+') out += ' ';
+            else if (s[i] == '%' && i + 2 < s.size() && (hi = hexDigit(s[i + 1])) >= 0 && (lo = hexDigit(s[i + 2])) >= 0) {
+                out += (char)(hi * 16 + lo);
+                i += 2;
+            } else out += s[i];
         }
+    }
 
-        d.acronym = buildAcronym(title);
-        docs.push_back(move(d));
-        N = docs.size();
+    static bool parseCount(string_view s, int &v) {
+        if (s.empty() || s.size() > 9) return false;
+        v = 0;
+        for (char c : s) {
+            if (c < '0' || c > '9') return false;
+            v = v * 10 + (c - '0');
+        }
+        return true;
     }
 
-    void buildIndex() {
-        index.clear();
-        docFreq.clear();
-        for (auto &d : docs) {
-            unordered_set<string> seen;
-            for (auto &p : d.tf) {
-                const string &token = p.first;
-                int freq = p.second;
-                index[token][d.id] = freq;
-                if (!seen.count(token)) { docFreq[token]++; seen.insert(token); }
-            }
+    // length of the well-formed UTF-8 sequence at p (no overlongs,
+    // surrogates or code points past U+10FFFF), 0 if there is none
+    static size_t utf8Length(const unsigned char *p, size_t n) {
+        if (p[0] < 0x80) return 1;
+        size_t len = p[0] >= 0xc2 && p[0] <= 0xdf ? 2 : p[0] >= 0xe0 && p[0] <= 0xef ? 3 : p[0] >= 0xf0 && p[0] <= 0xf4 ? 4 : 0;
+        if (len == 0 || len > n) return 0;
+        unsigned char lo = 0x80, hi = 0xbf; // allowed range of the second byte
+        if (p[0] == 0xe0) lo = 0xa0;
+        else if (p[0] == 0xed) hi = 0x9f;
+        else if (p[0] == 0xf0) lo = 0x90;
+        else if (p[0] == 0xf4) hi = 0x8f;
+        if (p[1] < lo || p[1] > hi) return 0;
+        for (size_t i = 2; i < len; ++i) {
+            if ((p[i] & 0xc0) != 0x80) return 0;
+        }
+        return len;
+    }
+
+    // s as the inside of a JSON string; bytes that are not well-formed
+    // UTF-8 become U+FFFD, and with html the text is also escaped for
+    // markup (<, > and &)
+    static void appendEscaped(string &out, string_view s, bool html = false) {
+        const unsigned char *p = (const unsigned char *)s.data();
+        for (size_t i = 0; i < s.size();) {
+            unsigned char c = p[i];
+            size_t len = utf8Length(p + i, s.size() - i);
+            if (len == 0) { out += "\\ufffd"; i++; continue; }
+            if (len > 1) { out.append(s.data() + i, len); i += len; continue; }
+            i++;
+            if (c == '"' || c == '\\') { out += '\\'; out += c; }
+            else if (c < 0x20) {
+                char b[8];
+                out.append(b, snprintf(b, sizeof(b), "\\u%04x", c));
+            } else if (html && c == '<') out += "&lt;";
+            else if (html && c == '>') out += "&gt;";
+            else if (html && c == '&') out += "&amp;";
+            else out += c;
         }
     }
 
-    double idf(const string &token) {
-        int df = 0;
-        if (docFreq.find(token) != docFreq.end()) df = docFreq[token];
-        if (df == 0) return 0.0;
-        return log((double)N / (double)df);
+    static void appendJson(string &out, string_view s) {
+        out += '"';
+        appendEscaped(out, s);
+        out += '"';
     }
 
-    // Compute TF-IDF vector for a document (map from token->weight)
-    unordered_map<string,double> docVector(const Doc &d) {
-        unordered_map<string,double> vec;
-        double norm = 0.0;
-        for (auto &p : d.tf) {
-            double w = (1 + log(p.second)) * idf(p.first);
-            vec[p.first] = w;
-            norm += w*w;
+    // the snippet as HTML with its marks as <b> tags, as a JSON string; the
+    // doc text is HTML-escaped so only the marks are markup. Written in place
+    // rather than through Snippet::render, which builds a new string
+    static void appendSnippet(string &out, const Snippet &s) {
+        string_view text = s.text;
+        size_t at = 0;
+        out += '"';
+        for (auto &m : s.marks) {
+            appendEscaped(out, text.substr(at, m.first - at), true);
+            out += "<b>";
+            appendEscaped(out, text.substr(m.first, m.second), true);
+            out += "</b>";
+            at = m.first + m.second;
         }
-        norm = sqrt(norm);
-        if (norm == 0) return vec;
-        for (auto &x : vec) x.second /= norm; // normalize
-        return vec;
+        appendEscaped(out, text.substr(at), true);
+        out += '"';
     }
 
-    // Compute TF-IDF vector for query tokens
-    unordered_map<string,double> queryVector(const vector<string> &qtokens) {
-        unordered_map<string,int> qtf;
-        for (auto &t : qtokens) if (!stopwords.count(t)) qtf[t]++;
-        unordered_map<string,double> vec;
-        double norm = 0.0;
-        for (auto &p : qtf) {
-            double w = (1 + log(p.second)) * idf(p.first);
-            vec[p.first] = w;
-            norm += w*w;
+    template <class... A>
+    static void appendf(string &out, const char *fmt, A... args) {
+        char b[64];
+        out.append(b, min(sizeof(b) - 1, (size_t)snprintf(b, sizeof(b), fmt, args...)));
+    }
+
+    void watch(int fd, uint32_t events, int op) {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.fd = fd;
+        epoll_ctl(epollFd, op, fd, &ev);
+    }
+
+    void acceptAll() {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if ((size_t)fd >= conns.size()) conns.resize(fd + 1);
+            if (spare.empty()) conns[fd] = make_unique<Conn>();
+            else { conns[fd] = move(spare.back()); spare.pop_back(); }
+            Conn &c = *conns[fd];
+            c.fd = fd;
+            c.lastActive = chrono::steady_clock::now();
+            watch(fd, EPOLLIN, EPOLL_CTL_ADD);
         }
-        norm = sqrt(norm);
-        if (norm == 0) return vec;
-        for (auto &x : vec) x.second /= norm;
-        return vec;
     }
 
-    // Cosine similarity between doc vector and query vector
-    double cosineSimilarity(const unordered_map<string,double> &dvec, const unordered_map<string,double> &qvec) {
-        double s = 0.0;
-        // iterate over smaller map for efficiency
-        if (qvec.size() < dvec.size()) {
-            for (auto &q : qvec) {
-                auto it = dvec.find(q.first);
-                if (it != dvec.end()) s += it->second * q.second;
-            }
-        } else {
-            for (auto &d : dvec) {
-                auto it = qvec.find(d.first);
-                if (it != qvec.end()) s += d.second * it->second;
+    void closeConn(Conn &c) {
+        int fd = c.fd;
+        ::close(fd);
+        c.fd = -1;
+        c.in.clear();
+        c.out.clear();
+        if (c.out.capacity() > (1 << 20)) c.out.shrink_to_fit();
+        c.sent = 0;
+        c.closing = c.polling = false;
+        spare.push_back(move(conns[fd]));
+    }
+
+    // Writes what it can of the output. Returns false if the connection got closed.
+    bool flush(Conn &c) {
+        while (c.sent < c.out.size()) {
+            ssize_t n = send(c.fd, c.out.data() + c.sent, c.out.size() - c.sent, MSG_NOSIGNAL);
+            if (n > 0) { c.sent += n; c.lastActive = chrono::steady_clock::now(); continue; }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // stop reading until the client takes its responses
+                if (!c.polling) { watch(c.fd, EPOLLOUT, EPOLL_CTL_MOD); c.polling = true; }
+                return true;
             }
+            closeConn(c);
+            return false;
         }
-        return s;
+        c.out.clear();
+        c.sent = 0;
+        if (c.closing) { closeConn(c); return false; }
+        if (c.polling) { watch(c.fd, EPOLLIN, EPOLL_CTL_MOD); c.polling = false; }
+        return true;
     }
 
-    // Search interface
-    vector<pair<int,double>> search(const string &rawQuery, int topK = 10) {
-        string q = toLower(rawQuery);
-        vector<pair<int,double>> ranked; // {docId, score}
+    Slot &newSlot(Conn &c) {
+        if (batch == slots.size()) slots.emplace_back();
+        Slot &s = slots[batch++];
+        s.conn = &c;
+        s.keepAlive = true;
+        s.status = 200;
+        s.error = nullptr;
+        s.metrics = false;
+        s.query.clear();
+        s.offset = 0;
+        s.limit = 10;
+        s.window = 0;
+        s.same = -1;
+        return s;
+    }
 
-        // Detect phrase search (if query inside double quotes)
-        bool phraseSearch = false;
-        string phrase;
-        size_t firstQ = rawQuery.find('"');
-        size_t lastQ = rawQuery.rfind('"');
-        if (firstQ != string::npos && lastQ != string::npos && firstQ != lastQ) {
-            phraseSearch = true;
-            phrase = rawQuery.substr(firstQ+1, lastQ-firstQ-1);
-            phrase = toLower(phrase);
-        }
+    static void fail(Slot &s, int status, const char *error, bool close = false) {
+        if (s.status != 200) return; // keep the first error
+        s.status = status;
+        s.error = error;
+        if (close) s.keepAlive = false;
+    }
 
-        // tokenize raw query for vector/keyword search
-        vector<string> qtokens = tokenize(q);
-        // build query vector (TF-IDF) if long enough
-        bool longQuery = (rawQuery.size() > 30 || qtokens.size() > 3);
+    // request line and headers, without the blank line
+    void parseRequest(string_view req, Slot &s) {
+        size_t eol = req.find("\r\n");
+        string_view line = req.substr(0, eol);
+        string_view headers = eol == string_view::npos ? string_view() : req.substr(eol + 2);
+        size_t sp1 = line.find(' '), sp2 = line.rfind(' ');
+        if (sp1 == string_view::npos || sp2 == sp1) { fail(s, 400, "malformed request line", true); return; }
+        string_view method = line.substr(0, sp1), target = line.substr(sp1 + 1, sp2 - sp1 - 1), version = line.substr(sp2 + 1);
+        if (version == "HTTP/1.0") s.keepAlive = false;
+        else if (version != "HTTP/1.1") { fail(s, 505, "HTTP version not supported", true); return; }
 
-        unordered_map<string,double> qvec;
-        if (longQuery) qvec = queryVector(qtokens);
+        while (!headers.empty()) {
+            size_t e = headers.find("\r\n");
+            string_view h = headers.substr(0, e);
+            headers = e == string_view::npos ? string_view() : headers.substr(e + 2);
+            size_t colon = h.find(':');
+            if (colon == string_view::npos) continue;
+            string_view name = trim(h.substr(0, colon)), value = trim(h.substr(colon + 1));
+            if (equalsNoCase(name, "connection")) {
+                if (equalsNoCase(value, "close")) s.keepAlive = false;
+                else if (equalsNoCase(value, "keep-alive")) s.keepAlive = true;
+            } else if ((equalsNoCase(name, "content-length") && value != "0") || equalsNoCase(name, "transfer-encoding")) {
+                fail(s, 400, "request bodies are not supported", true); // cannot tell where the next request starts
+            }
+        }
+        if (method != "GET") { fail(s, 405, "only GET is supported"); return; }
 
-        // Acronym / shortform match
-        string qAcr = "";
-        // if user wrote uppercase letters no quotes and length <= 6 we assume shortform
-        bool maybeAcr = false;
-        bool allUpper = true;
-        for (char c : rawQuery) {
-            if (isalpha((unsigned char)c) && islower((unsigned char)c)) { allUpper = false; break; }
+        size_t qm = target.find('?');
+        string_view path = target.substr(0, qm), params = qm == string_view::npos ? string_view() : target.substr(qm + 1);
+        if (path == "/metrics") { s.metrics = true; return; }
+        if (path != "/search") { fail(s, 404, "unknown path"); return; }
+        while (!params.empty()) {
+            size_t amp = params.find('&');
+            string_view kv = params.substr(0, amp);
+            params = amp == string_view::npos ? string_view() : params.substr(amp + 1);
+            size_t eq = kv.find('=');
+            string_view name = kv.substr(0, eq), value = eq == string_view::npos ? string_view() : kv.substr(eq + 1);
+            if (name == "q") urlDecode(value, s.query);
+            else if (name == "offset" && !parseCount(value, s.offset)) fail(s, 400, "bad offset");
+            else if (name == "limit" && !parseCount(value, s.limit)) fail(s, 400, "bad limit");
         }
-        if (rawQuery.size() <= 6 && allUpper && rawQuery.find(' ') == string::npos) { // SHORT heuristic
-            maybeAcr = true;
-            qAcr = toLower(rawQuery);
-        } else {
-            // also build acronym of query tokens (first letters)
-            string acr="";
-            for (auto &t : qtokens) if (!stopwords.count(t) && !t.empty()) acr.push_back(t[0]);
-            if (!acr.empty()) { maybeAcr = true; qAcr = acr; }
+        if (s.query.empty()) fail(s, 400, "missing q");
+        if (s.limit < 1 || s.limit > kMaxLimit) fail(s, 400, "limit out of range");
+        // one result past the page tells whether there is a next one
+        if (s.offset < kMaxResults) s.window = min(kMaxResults, (s.offset + s.limit + kWindow) / kWindow * kWindow);
+    }
+
+    // reads what arrived and turns every complete request into a slot
+    void readFrom(Conn &c) {
+        size_t before = batch, got = 0;
+        while (got < 4 * kMaxRequest) {
+            size_t old = c.in.size();
+            c.in.resize(old + kMaxRequest);
+            ssize_t n = recv(c.fd, &c.in[old], kMaxRequest, 0);
+            c.in.resize(old + max<ssize_t>(n, 0));
+            if (n > 0) { got += n; continue; }
+            if (n == 0) { c.closing = true; break; } // the client is done sending
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            closeConn(c);
+            return;
         }
+        c.lastActive = chrono::steady_clock::now();
 
-        // Prepare candidate doc set: union of docs containing any token OR substring OR acronym OR fuzzy
-        unordered_set<int> candidates;
-        for (auto &t : qtokens) {
-            if (index.count(t)) {
-                for (auto &p : index[t]) candidates.insert(p.first);
+        size_t pos = 0;
+        while (true) {
+            size_t end = c.in.find("\r\n\r\n", pos);
+            if (end == string::npos) {
+                if (c.in.size() - pos > kMaxRequest) {
+                    fail(newSlot(c), 431, "request too large", true);
+                    c.closing = true;
+                }
+                break;
             }
+            Slot &s = newSlot(c);
+            parseRequest(string_view(c.in).substr(pos, end - pos), s);
+            pos = end + 4;
+            if (!s.keepAlive) { c.closing = true; break; }
         }
-        // substring / phrase candidates (cheap full text scan)
-        for (auto &d : docs) {
-            string hay = toLower(d.title + " " + d.content);
-            if (hay.find(q) != string::npos) candidates.insert(d.id);
-            if (phraseSearch) {
-                if (hay.find(phrase) != string::npos) candidates.insert(d.id);
+        c.in.erase(0, pos);
+        if (c.closing && batch == before && c.out.empty()) closeConn(c);
+    }
+
+    void evaluate() {
+        snap = engine.snapshot();
+        distinct.clear();
+        for (size_t i = 0; i < batch; ++i) {
+            Slot &s = slots[i];
+            s.results.clear();
+            if (s.status != 200 || s.metrics || !s.window) continue;
+            for (int j : distinct) {
+                if (slots[j].window == s.window && slots[j].query == s.query) { s.same = j; break; }
             }
+            if (s.same < 0) distinct.push_back(i);
         }
-        // acronym candidates
-        if (maybeAcr && !qAcr.empty()) {
-            for (auto &d : docs) {
-                if (d.acronym.size() && toLower(d.acronym).find(qAcr) != string::npos) candidates.insert(d.id);
-            }
+        pool.parallelFor(distinct.size(), [&](int k) {
+            Slot &s = slots[distinct[k]];
+            s.profile = QueryProfile();
+            snap->search(s.query, s.window, s.profile, s.key, s.results);
+        });
+        for (size_t i = 0; i < batch; ++i) {
+            if (slots[i].same >= 0) slots[i].results = slots[slots[i].same].results;
+        }
+    }
+
+    static const char *reasonOf(int status) {
+        switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 431: return "Request Header Fields Too Large";
+        case 505: return "HTTP Version Not Supported";
         }
-        // fuzzy candidates: if token doesn't exist in index, look for tokens within edit distance 1
-        for (auto &t : qtokens) {
-            if (index.count(t)) continue;
-            for (auto &entry : docFreq) {
-                const string &tok = entry.first;
-                if (abs((int)tok.size() - (int)t.size()) > 1) continue;
-                if (levenshtein(tok, t) <= 1) {
-                    // add docs which have tok
-                    for (auto &p : index[tok]) candidates.insert(p.first);
+        return "Error";
+    }
+
+    void respond(Slot &s) {
+        const char *type = "application/json";
+
+        body.clear();
+        if (s.status != 200) {
+            body += "{\"error\":";
+            appendJson(body, s.error);
+            body += "}\n";
+        } else if (s.metrics) {
+            body = engine.metricsText();
+            type = "text/plain; version=0.0.4";
+        } else {
+            body += "{\"query\":";
+            appendJson(body, s.query);
+            appendf(body, ",\"offset\":%d,\"limit\":%d,\"results\":[", s.offset, s.limit);
+            int end = min((int)s.results.size(), s.offset + s.limit);
+            if (end > s.offset) snap->snippetTerms(s.query, scratch.terms);
+            for (int i = s.offset; i < end; ++i) {
+                appendf(body, "%s{\"id\":%d,\"score\":%.6g", i > s.offset ? "," : "", s.results[i].first, s.results[i].second);
+                uint32_t ord;
+                if (const Segment *seg = snap->locate(s.results[i].first, ord)) {
+                    Doc d = seg->docs[ord];
+                    body += ",\"title\":";
+                    appendJson(body, d.title);
+                    body += ",\"link\":";
+                    appendJson(body, d.link);
+                    snap->snippet(*seg, ord, scratch.terms, snip, scratch);
+                    body += ",\"snippet\":";
+                    appendSnippet(body, snip);
                 }
+                body += '}';
             }
+            body += "],\"more\":";
+            body += (int)s.results.size() > s.offset + s.limit ? "true" : "false";
+            body += "}\n";
         }
 
-        // If no candidates found but there are docs, fallback to all docs (so we can compute similarity)
-        if (candidates.empty()) {
-            for (auto &d : docs) candidates.insert(d.id);
+        string &out = s.conn->out;
+        appendf(out, "HTTP/1.1 %d %s\r\n", s.status, reasonOf(s.status));
+        out += "Content-Type: ";
+        out += type;
+        appendf(out, "\r\nContent-Length: %zu\r\n", body.size());
+        out += s.keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+        out += body;
+    }
+
+    void closeIdle() {
+        auto now = chrono::steady_clock::now();
+        for (auto &c : conns) {
+            if (c && c->out.empty() && now - c->lastActive > chrono::seconds(kIdleSeconds)) closeConn(*c);
         }
+    }
 
-        // Score each candidate
-        unordered_map<int, double> scoreMap;
-        for (int docId : candidates) {
-            // find doc record
-            const Doc *docPtr = nullptr;
-            for (auto &d : docs) if (d.id == docId) { docPtr = &d; break; }
-            if (!docPtr) continue;
-            const Doc &d = *docPtr;
+public:
+    // threads: evaluation threads, the loop thread included
+    explicit HttpServer(const SearchEngine &e, int threads = max(1u, thread::hardware_concurrency()))
+        : engine(e), pool(max(0, threads - 1)) {}
 
-            double score = 0.0;
+    ~HttpServer() {
+        for (auto &c : conns) if (c) ::close(c->fd);
+        for (int fd : {listenFd, epollFd, wakeFd}) if (fd >= 0) ::close(fd);
+    }
 
-            // 1) phrase / substring exact match gives big boost
-            string hay = toLower(d.title + " " + d.content);
-            if (phraseSearch) {
-                if (hay.find(phrase) != string::npos) score += 3.0;
-            }
-            if (hay.find(q) != string::npos) score += 2.0;
+    // Listens on 127.0.0.1:port; port 0 picks a free one, see port()
+    bool start(int port, string &err) {
+        listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFd < 0) { err = "cannot create socket"; return false; }
+        int one = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(listenFd, (sockaddr*)&addr, sizeof(addr)) != 0) { err = "cannot bind 127.0.0.1:" + to_string(port); return false; }
+        if (listen(listenFd, 256) != 0) { err = "cannot listen"; return false; }
+        socklen_t len = sizeof(addr);
+        getsockname(listenFd, (sockaddr*)&addr, &len);
+        boundPort = ntohs(addr.sin_port);
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epollFd < 0 || wakeFd < 0) { err = "cannot create epoll instance"; return false; }
+        watch(listenFd, EPOLLIN, EPOLL_CTL_ADD);
+        watch(wakeFd, EPOLLIN, EPOLL_CTL_ADD);
+        return true;
+    }
+
+    int port() const { return boundPort; }
 
-            // 2) acronym match boost
-            if (maybeAcr && !qAcr.empty()) {
-                if (!d.acronym.empty() && toLower(d.acronym).find(qAcr) != string::npos) score += 2.0;
+    // serves until stop()
+    void run() {
+        epoll_event events[64];
+        auto lastSweep = chrono::steady_clock::now();
+        while (!stopping) {
+            int n = epoll_wait(epollFd, events, 64, 1000);
+            if (n < 0 && errno != EINTR) break;
+            batch = 0;
+            for (int i = 0; i < n; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == wakeFd || fd == listenFd) {
+                    if (fd == listenFd) acceptAll();
+                    continue;
+                }
+                if ((size_t)fd >= conns.size() || !conns[fd]) continue;
+                Conn &c = *conns[fd];
+                if ((events[i].events & EPOLLOUT) && !flush(c)) continue;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    if (c.polling) continue; // answers first
+                    readFrom(c);
+                }
             }
+            if (batch) {
+                evaluate();
+                for (size_t i = 0; i < batch; ++i) {
+                    respond(slots[i]);
+                    // a connection's requests are adjacent; write once after the last
+                    if (i + 1 == batch || slots[i + 1].conn != slots[i].conn) flush(*slots[i].conn);
+                }
+                snap.reset();
+            }
+            auto now = chrono::steady_clock::now();
+            if (now - lastSweep > chrono::seconds(1)) { closeIdle(); lastSweep = now; }
+        }
+    }
 
-            // 3) token overlap / tf-idf for keywords or longQuery (cosine similarity)
-            if (longQuery) {
-                auto dvec = docVector(d);
-                double sim = cosineSimilarity(dvec, qvec);
-                score += sim * 5.0; // scale up similarity
-            } else {
-                // simpler token-based scoring for short queries
-                double tokenScore = 0.0;
-                for (auto &t : qtokens) {
-                    if (d.tf.find(t) != d.tf.end()) tokenScore += (1 + log(d.tf.at(t))) * idf(t);
-                    else {
-                        // reward fuzzy tokens that are close
-                        for (auto &p : d.tf) {
-                            if (levenshtein(p.first, t) <= 1) { tokenScore += 0.3; break; }
-                        }
-                    }
+    // asks run() to return; safe from any thread or a signal handler
+    void stop() {
+        stopping = true;
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) < 0) {} // the loop also wakes up every second
+    }
+};
+
+// -------------------- Bulk loading --------------------
+// Parsers for one corpus line: JSONL objects with id, title, content and link
+// members (other members are skipped), or TSV rows id<TAB>title<TAB>content<TAB>link.
+
+// append the UTF-8 encoding of code point cp
+void appendUtf8(string &out, uint32_t cp) {
+    if (cp < 0x80) out.push_back(cp);
+    else if (cp < 0x800) { out.push_back(0xc0 | (cp >> 6)); out.push_back(0x80 | (cp & 0x3f)); }
+    else if (cp < 0x10000) { out.push_back(0xe0 | (cp >> 12)); out.push_back(0x80 | ((cp >> 6) & 0x3f)); out.push_back(0x80 | (cp & 0x3f)); }
+    else { out.push_back(0xf0 | (cp >> 18)); out.push_back(0x80 | ((cp >> 12) & 0x3f)); out.push_back(0x80 | ((cp >> 6) & 0x3f)); out.push_back(0x80 | (cp & 0x3f)); }
+}
+
+class JsonLine {
+private:
+    const char *p, *end;
+
+    void ws() { while (p < end && isspace((unsigned char)*p)) p++; }
+    bool eat(char c) { ws(); if (p < end && *p == c) { p++; return true; } return false; }
+
+    bool hex4(uint32_t &v) {
+        if (end - p < 4) return false;
+        v = 0;
+        for (int i = 0; i < 4; ++i, ++p) {
+            int c = *p, h = isdigit(c) ? c - '0' : (c | 0x20) >= 'a' && (c | 0x20) <= 'f' ? (c | 0x20) - 'a' + 10 : -1;
+            if (h < 0) return false;
+            v = v * 16 + h;
+        }
+        return true;
+    }
+
+public:
+    JsonLine(string_view s) : p(s.data()), end(s.data() + s.size()) {}
+
+    bool str(string &out) {
+        out.clear();
+        if (!eat('"')) return false;
+        while (p < end && *p != '"') {
+            if (*p != '\\') { out.push_back(*p++); continue; }
+            if (++p == end) return false;
+            char c = *p++;
+            switch (c) {
+            case 'n': out.push_back('\n'); break;
+            case 't': out.push_back('\t'); break;
+            case 'r': out.push_back('\r'); break;
+            case 'b': out.push_back('\b'); break;
+            case 'f': out.push_back('\f'); break;
+            case 'u': {
+                uint32_t cp, lo;
+                if (!hex4(cp)) return false;
+                if (cp >= 0xd800 && cp < 0xdc00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                    p += 2;
+                    if (!hex4(lo)) return false;
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
                 }
-                score += tokenScore;
+                appendUtf8(out, cp);
+                break;
+            }
+            default: out.push_back(c); // \" \\ \/
+            }
+        }
+        return eat('"');
+    }
+
+    // skip any value; numbers and literals are returned in raw
+    bool value(string &raw) {
+        ws();
+        if (p == end) return false;
+        if (*p == '"') return str(raw);
+        if (*p == '{' || *p == '[') {
+            int depth = 0;
+            string tmp;
+            while (p < end) {
+                if (*p == '"') { if (!str(tmp)) return false; continue; }
+                if (*p == '{' || *p == '[') depth++;
+                else if ((*p == '}' || *p == ']') && --depth == 0) { p++; return true; }
+                p++;
             }
+            return false;
+        }
+        const char *s = p;
+        while (p < end && *p != ',' && *p != '}' && !isspace((unsigned char)*p)) p++;
+        raw.assign(s, p);
+        return p > s;
+    }
 
-            // 4) small bonus if title contains query tokens (title is more important)
-            for (auto &t : qtokens) {
-                vector<string> titleTokens = tokenize(toLower(d.title));
-                for (auto &tt : titleTokens) if (tt == t) { score += 0.6; break; }
+    bool doc(DocRecord &d) {
+        if (!eat('{')) return false;
+        bool haveId = false;
+        string key, val;
+        if (eat('}')) return false;
+        do {
+            if (!str(key) || !eat(':') || !value(val)) return false;
+            if (key == "id") {
+                char *e;
+                long v = strtol(val.c_str(), &e, 10);
+                if (e == val.c_str() || *e) return false;
+                d.id = v;
+                haveId = true;
             }
+            else if (key == "title") d.title.swap(val);
+            else if (key == "content") d.content.swap(val);
+            else if (key == "link") d.link.swap(val);
+        } while (eat(','));
+        return eat('}') && haveId;
+    }
+};
+
+bool parseTsvDoc(string_view line, DocRecord &d) {
+    string_view f[4];
+    for (int i = 0; i < 4; ++i) {
+        size_t tab = i < 3 ? line.find('\t') : string_view::npos;
+        if (i < 3 && tab == string_view::npos) return false;
+        f[i] = line.substr(0, tab);
+        if (i < 3) line.remove_prefix(tab + 1);
+    }
+    if (!f[3].empty() && f[3].back() == '\r') f[3].remove_suffix(1);
+    string id(f[0]);
+    char *e;
+    d.id = strtol(id.c_str(), &e, 10);
+    if (id.empty() || *e) return false; // also skips a header row
+    d.title = f[1];
+    d.content = f[2];
+    d.link = f[3];
+    return true;
+}
 
-            // 5) small length normalization: shorter doc that matches exactly might be more relevant
-            double lenFactor = 1.0;
-            int totalTok = d.tokens.size() ? (int)d.tokens.size() : 1;
-            lenFactor = 1.0 / sqrt(totalTok / 50.0 + 1.0); // heuristic
-            score *= lenFactor;
+struct LoadOptions {
+    bool tsv = false;                  // default JSONL
+    size_t memoryBudget = 256u << 20;  // estimated index bytes held before a segment is flushed
+    string segmentPrefix = "load";     // segments are spilled to <prefix>.<n>.seg
+    bool progress = true;              // report to stderr about once a second
+};
 
-            scoreMap[docId] = score;
-        }
+struct LoadStats {
+    size_t docs = 0;
+    size_t skipped = 0;   // lines that did not parse
+    size_t segments = 0;
+    double seconds = 0;
+};
 
-        // Move to vector and sort by score desc
-        for (auto &p : scoreMap) {
-            ranked.push_back({p.first, p.second});
+// Rough bytes of index per byte of text while a segment is being built
+// (tokens, positions, postings and the stored fields themselves).
+const size_t kIndexBytesPerTextByte = 4;
+
+// Stream a corpus file into engine. The file is mapped and parsed on a reader
+// thread, batches are handed to the indexing side through a bounded queue,
+// and whenever the docs held in memory would exceed the budget they are
+// refreshed into a segment that is spilled to disk (see setSpill()). Merges
+// are capped so that none holds more than the budget either; the engine
+// keeps its segments on disk afterwards.
+bool loadCorpus(SearchEngine &engine, const string &path, const LoadOptions &opt, LoadStats &stats, string &err) {
+    MappedFile in;
+    if (!in.open(path, err)) return false;
+    madvise((void*)in.data(), in.size(), MADV_SEQUENTIAL);
+    const char *base = (const char*)in.data();
+    size_t total = in.size();
+
+    const size_t kBatch = 1024, kMaxBatches = 4;
+    deque<vector<DocRecord>> queue;
+    mutex mu;
+    condition_variable cv;
+    bool eof = false;
+    atomic<size_t> readPos{0}, skipped{0};
+
+    thread reader([&]{
+        vector<DocRecord> batch;
+        size_t pos = 0;
+        while (pos < total) {
+            const char *nl = (const char*)memchr(base + pos, '\n', total - pos);
+            size_t len = nl ? nl - (base + pos) : total - pos;
+            string_view line(base + pos, len);
+            pos += len + 1;
+            if (line.find_first_not_of(" \t\r") == string_view::npos) continue;
+            DocRecord d;
+            bool ok = opt.tsv ? parseTsvDoc(line, d) : JsonLine(line).doc(d);
+            if (!ok) { skipped++; continue; }
+            batch.push_back(move(d));
+            if (batch.size() == kBatch || pos >= total) {
+                unique_lock<mutex> lock(mu);
+                cv.wait(lock, [&]{ return queue.size() < kMaxBatches; });
+                queue.push_back(move(batch));
+                batch.clear();
+                readPos = min(pos, total);
+                cv.notify_all();
+            }
         }
-        sort(ranked.begin(), ranked.end(), [](const pair<int,double> &a, const pair<int,double> &b){
-            if (fabs(a.second - b.second) > 1e-9) return a.second > b.second;
-            return a.first < b.first;
-        });
+        lock_guard<mutex> lock(mu);
+        if (!batch.empty()) queue.push_back(move(batch));
+        readPos = total;
+        eof = true;
+        cv.notify_all();
+    });
+
+    auto start = chrono::steady_clock::now(), lastReport = start;
+    auto elapsed = [&]{ return chrono::duration<double>(chrono::steady_clock::now() - start).count(); };
+    // a merge holds about twice the bytes of its stored docs (the docs and
+    // the postings inverted from them)
+    engine.setSpill(opt.segmentPrefix, opt.memoryBudget / 2);
+    size_t held = 0, segments = 0; // text bytes buffered in engine, segments flushed
+    bool ok = true;
+    auto flush = [&]{
+        engine.refresh();
+        segments++;
+        held = 0;
+        err = engine.spillError();
+        return err.empty();
+    };
 
-        // trim zeros and keep topK
-        vector<pair<int,double>> res;
-        for (auto &r : ranked) {
-            if (r.second <= 0 && (int)res.size() >= topK) break;
-            if ((int)res.size() < topK) res.push_back(r);
-            else break;
+    while (ok) {
+        vector<DocRecord> batch;
+        {
+            unique_lock<mutex> lock(mu);
+            cv.wait(lock, [&]{ return eof || !queue.empty(); });
+            if (queue.empty()) break;
+            batch = move(queue.front());
+            queue.pop_front();
+            cv.notify_all();
+        }
+        for (auto &d : batch) {
+            engine.addDoc(d.id, d.title, d.content, d.link);
+            held += d.title.size() + d.content.size() + d.link.size();
+            stats.docs++;
+            if (held * kIndexBytesPerTextByte >= opt.memoryBudget && !(ok = flush())) break;
+        }
+        if (opt.progress && chrono::steady_clock::now() - lastReport > chrono::seconds(1)) {
+            lastReport = chrono::steady_clock::now();
+            fprintf(stderr, "\r%zu docs, %.1f%% read, %.0f docs/s, %zu segments", stats.docs,
+                    total ? 100.0 * readPos / total : 100.0, stats.docs / elapsed(), segments);
         }
-        return res;
     }
+    if (!ok) { // let the reader finish
+        unique_lock<mutex> lock(mu);
+        while (!eof) { queue.clear(); cv.notify_all(); cv.wait(lock); }
+    }
+    reader.join();
+    if (ok && held) ok = flush();
+    stats.skipped = skipped;
+    stats.segments = segments;
+    stats.seconds = elapsed();
+    if (opt.progress) {
+        fprintf(stderr, "\r%zu docs in %.2fs (%.0f docs/s), %zu skipped lines, %zu segments\n", stats.docs,
+                stats.seconds, stats.docs / max(stats.seconds, 1e-9), stats.skipped, stats.segments);
+    }
+    return ok;
+}
 
-    const Doc* getDocById(int id) const {
-        for (auto &d : docs) if (d.id == id) return &d;
-        return nullptr;
+// -------------------- Micro-benchmarks --------------------
+// --bench-tokenizer FILE: tokenizing throughput over the lines of a file (one
+// doc per line) for the original tokenizer and each classify kernel, best of 5
+void benchTokenizer(const string &path) {
+    ifstream in(path, ios::binary);
+    vector<string> lines;
+    size_t bytes = 0;
+    for (string line; getline(in, line); ) {
+        bytes += line.size() + 1;
+        lines.push_back(move(line));
     }
+    if (lines.empty()) { cout << "Cannot read " << path << "\n"; return; }
+    auto run = [&](const string &name, const function<size_t(const string&)> &fn) {
+        double best = 1e30;
+        size_t count = 0;
+        for (int r = 0; r < 5; ++r) {
+            auto t0 = chrono::steady_clock::now();
+            count = 0;
+            for (auto &l : lines) count += fn(l);
+            best = min(best, chrono::duration<double>(chrono::steady_clock::now() - t0).count());
+        }
+        cout << left << setw(8) << name << right << fixed << setprecision(1) << setw(9) << bytes / best / 1e6
+             << " MB/s  " << count << " tokens\n";
+    };
+    cout << bytes << " bytes, " << lines.size() << " lines\n";
+    run("simple", [](const string &l) { return tokenizeSimple(l).size(); });
+    vector<pair<string,ClassifyFn>> kernels = {{"scalar", classifyScalar}};
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sse2")) kernels.push_back({"sse2", classifySse2});
+    if (__builtin_cpu_supports("avx2")) kernels.push_back({"avx2", classifyAvx2});
+#endif
+    for (auto &k : kernels) {
+        Tokenizer tok(k.second);
+        run(k.first, [&](const string &l) { return tok(l).size(); });
+    }
+}
 
-    void printDocSummary(const Doc &d) const {
-        cout << "ID: " << d.id << " | Title: " << d.title << " | Link: " << d.link << "\n";
-        string snippet = d.content.substr(0, 160);
-        if (d.content.size() > 160) snippet += "...";
-        cout << snippet << "\n";
+// Synthetic corpus for --bench: words drawn from a Zipf(1) distribution over
+// a generated vocabulary, so term frequencies, posting list lengths and
+// query costs look like those of natural text. Deterministic for a seed.
+class SyntheticCorpus {
+private:
+    mt19937_64 rng;
+    vector<string> vocab;    // by rank, most frequent first
+    vector<double> cdf;      // cumulative Zipf probabilities
+
+public:
+    explicit SyntheticCorpus(size_t vocabSize = 200000, uint64_t seed = 42) : rng(seed) {
+        const char *syll[] = {"ka","ri","to","ne","sa","mo","lu","pe","di","go","ra","ve","chi","an","el","or","us","ix","om","ta"};
+        unordered_set<string> seen;
+        while (vocab.size() < vocabSize) {
+            string w;
+            // frequent words are short, as in natural text
+            int n = 1 + (int)min<size_t>(4, vocab.size() < 200 ? rng() % 2 : 1 + rng() % 4);
+            for (int i = 0; i < n; ++i) w += syll[rng() % 20];
+            if (seen.insert(w).second) vocab.push_back(w);
+        }
+        double sum = 0;
+        for (size_t r = 1; r <= vocabSize; ++r) cdf.push_back(sum += 1.0 / r);
+        for (auto &c : cdf) c /= sum;
     }
 
-    void printDocFull(const Doc &d) const {
-        cout << "\n----- " << d.title << " -----\n";
-        cout << "Link: " << d.link << "\n";
-        cout << d.content << "\n------------------------\n";
+    size_t rank() { return lower_bound(cdf.begin(), cdf.end(), uniform_real_distribution<double>()(rng)) - cdf.begin(); }
+    const string &word() { return vocab[min(rank(), vocab.size() - 1)]; }
+    const string &word(size_t rank) const { return vocab[rank]; }
+    size_t below(size_t n) { return rng() % n; }
+
+    string text(int words) {
+        string s;
+        for (int i = 0; i < words; ++i) {
+            if (i) s += ' ';
+            s += word();
+        }
+        return s;
     }
 };
 
+// --bench DOCS: index DOCS synthetic docs, then replay a mix of query kinds
+// and report indexing throughput, index size and latency percentiles
+void benchEngine(SearchEngine &engine, size_t docs, size_t queriesPerKind) {
+    SyntheticCorpus corpus;
+    vector<string> phrases, titles; // samples of indexed text to build queries from
+    size_t bytes = 0;
+    auto t0 = chrono::steady_clock::now();
+    for (size_t i = 0; i < docs; ++i) {
+        string title = corpus.text(2 + corpus.below(6));
+        string content = corpus.text(30 + corpus.below(300));
+        bytes += title.size() + content.size();
+        if (corpus.below(docs / 1000 + 1) == 0) {
+            size_t at = content.find(' ', corpus.below(content.size() / 2));
+            if (at != string::npos) {
+                size_t end = at + 1;
+                for (int w = 0; w < 2 && end != string::npos; ++w) end = content.find(' ', end + 1);
+                phrases.push_back(content.substr(at + 1, end == string::npos ? string::npos : end - at - 1));
+            }
+            titles.push_back(title);
+        }
+        engine.addDoc((int)i, title, content, "bench:" + to_string(i));
+        if ((i + 1) % 100000 == 0) engine.refresh();
+    }
+    engine.refresh();
+    double indexSecs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    auto st = engine.indexStats();
+    size_t rssKb = 0;
+    ifstream status("/proc/self/status");
+    for (string line; getline(status, line); ) {
+        if (line.rfind("VmRSS:", 0) == 0) rssKb = atol(line.c_str() + 6);
+    }
+    cout << fixed << setprecision(1);
+    cout << "Indexed " << docs << " docs (" << bytes / 1e6 << " MB) in " << indexSecs << " s: "
+         << docs / max(indexSecs, 1e-9) << " docs/s, " << bytes / 1e6 / max(indexSecs, 1e-9) << " MB/s\n";
+    cout << "Index: " << st.segments << " segments, " << st.terms << " terms, " << st.postings << " postings; postings "
+         << st.bytes / 1e6 << " MB, positions " << st.posBytes / 1e6 << " MB, dictionary " << st.dictBytes / 1e6
+         << " MB, docs " << st.docBytes / 1e6 << " MB; RSS " << rssKb / 1024.0 << " MB\n";
+
+    // each kind draws its own queries from the corpus model or the samples
+    auto acronymOf = [](const string &title) {
+        string a;
+        for (auto &t : tokenize(title)) a += (char)toupper(t[0]);
+        return a.substr(0, 6);
+    };
+    vector<pair<string, function<string()>>> kinds = {
+        {"single", [&] { return corpus.word(10 + corpus.below(5000)); }},
+        {"multi", [&] { return corpus.text(2 + corpus.below(2)); }},
+        {"long", [&] { return corpus.text(6 + corpus.below(6)); }},
+        {"phrase", [&] { return phrases.empty() ? corpus.word() : "\"" + phrases[corpus.below(phrases.size())] + "\""; }},
+        {"typo", [&] {
+            string w = corpus.word(100 + corpus.below(20000));
+            w[corpus.below(w.size())] = 'a' + corpus.below(26);
+            return w;
+        }},
+        {"acronym", [&] { return titles.empty() ? string("AB") : acronymOf(titles[corpus.below(titles.size())]); }},
+    };
+    vector<vector<string>> queries(kinds.size());
+    for (size_t k = 0; k < kinds.size(); ++k) {
+        for (size_t q = 0; q < queriesPerKind; ++q) queries[k].push_back(kinds[k].second());
+    }
+    cout << left << setw(9) << "kind" << right << setw(9) << "queries" << setw(10) << "p50 us" << setw(10) << "p95 us"
+         << setw(10) << "p99 us" << setw(10) << "max us" << setw(10) << "mean us" << "\n";
+    vector<double> all;
+    for (size_t k = 0; k < kinds.size(); ++k) {
+        vector<double> us;
+        for (auto &query : queries[k]) {
+            auto s0 = chrono::steady_clock::now();
+            engine.search(query, 10);
+            us.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - s0).count());
+        }
+        all.insert(all.end(), us.begin(), us.end());
+        sort(us.begin(), us.end());
+        auto pct = [&](double p) { return us[min(us.size() - 1, (size_t)(p * us.size()))]; };
+        cout << left << setw(9) << kinds[k].first << right << setw(9) << us.size() << setw(10) << pct(0.50) << setw(10) << pct(0.95)
+             << setw(10) << pct(0.99) << setw(10) << us.back() << setw(10) << accumulate(us.begin(), us.end(), 0.0) / us.size() << "\n";
+    }
+    double total = accumulate(all.begin(), all.end(), 0.0);
+    cout << all.size() << " queries, " << total / 1e3 << " ms, " << all.size() / max(total / 1e6, 1e-9) << " queries/s (one thread)\n";
+
+    // The same queries by the shape of their plan: through the generic
+    // evaluator, through their plans as they are built, and again with the
+    // plans cached. The plans must not change any result.
+    const int shapes = (int)IndexSnapshot::QueryShape::SHAPES;
+    vector<vector<double>> generic(shapes), planned(shapes), cached(shapes);
+    vector<vector<pair<int,double>>> expect;
+    size_t differ = 0;
+    auto same = [](const vector<pair<int,double>> &a, const vector<pair<int,double>> &b) {
+        return a.size() == b.size() && equal(a.begin(), a.end(), b.begin(), [](const pair<int,double> &x, const pair<int,double> &y) {
+            return x.first == y.first && fabs(x.second - y.second) < 1e-9;
+        });
+    };
+    auto replay = [&](vector<vector<double>> &us, bool check) {
+        size_t i = 0;
+        for (auto &qs : queries) {
+            for (auto &query : qs) {
+                auto s0 = chrono::steady_clock::now();
+                auto r = engine.search(query, 10);
+                double t = chrono::duration<double, micro>(chrono::steady_clock::now() - s0).count();
+                us[(int)engine.queryShape(query)].push_back(t);
+                if (!check) expect.push_back(r);
+                else if (!same(r, expect[i])) differ++;
+                i++;
+            }
+        }
+    };
+    engine.setQueryPlans(false);
+    replay(generic, false);
+    engine.setQueryPlans(true); // a new generation: no plan is cached yet
+    replay(planned, true);
+    replay(cached, true);
+    auto median = [](vector<double> v) { sort(v.begin(), v.end()); return v[v.size() / 2]; };
+    cout << "\nQuery plans, p50 by shape:\n" << left << setw(9) << "shape" << right << setw(9) << "queries" << setw(12) << "generic us"
+         << setw(12) << "planned us" << setw(12) << "cached us" << setw(8) << "gain" << "\n";
+    for (int sh = 0; sh < shapes; ++sh) {
+        if (generic[sh].empty()) continue;
+        double g = median(generic[sh]), c = median(cached[sh]);
+        cout << left << setw(9) << IndexSnapshot::shapeNames[sh] << right << setw(9) << generic[sh].size() << setw(12) << g
+             << setw(12) << median(planned[sh]) << setw(12) << c << setw(7) << g / max(c, 1e-9) << "x\n";
+    }
+    if (differ) cout << differ << " planned results differ from the generic ones\n";
+
+    // Save the index and open it again with every checksum verified; after
+    // the same doc goes into both, no query may rank differently under
+    // either ranker.
+    string seg = "bench.roundtrip.seg", err;
+    SearchEngine reopened;
+    engine.setDenseProbes(0);
+    bool ok = engine.save(seg, err) && reopened.open(seg, err, true);
+    remove(seg.c_str());
+    if (!ok) { cout << "Round trip failed: " << err << "\n"; return; }
+    string title = corpus.text(4), content = corpus.text(100);
+    engine.addDoc((int)docs, title, content, "bench:" + to_string(docs));
+    reopened.addDoc((int)docs, title, content, "bench:" + to_string(docs));
+    engine.refresh();
+    reopened.refresh();
+    size_t compared = 0;
+    differ = 0;
+    for (Ranker r : {Ranker::Classic, Ranker::Bm25f}) {
+        engine.setRanker(r);
+        reopened.setRanker(r);
+        for (auto &qs : queries) {
+            for (auto &query : qs) {
+                differ += !same(engine.search(query, 10), reopened.search(query, 10));
+                compared++;
+            }
+        }
+    }
+    cout << "Round trip: saved, reopened with checksums verified, " << compared << " queries compared, " << differ << " differ\n";
+}
+
+// --bench-dense DOCS: index DOCS synthetic docs with dense retrieval on and
+// compare the dense top 10 of long queries, for a range of probes, with the
+// exact top 10 by tf-idf cosine from a scan of every doc ("recall@10"), and
+// with the dense top 10 when every list is probed ("ivf recall", the loss
+// due to the index rather than to the embeddings). Independent words have
+// no neighbourhoods to find, so each doc here is about one of kTopics topics,
+// which supply half of its words, and each query is a handful of words drawn
+// from one doc.
+void benchDense(SearchEngine &engine, size_t docs, size_t queries) {
+    const int kTopics = 200, kTopicWords = 500;
+    SyntheticCorpus corpus;
+    auto topicText = [&](int topic, int words) {
+        string s;
+        for (int i = 0; i < words; ++i) {
+            if (i) s += ' ';
+            s += corpus.below(2) ? corpus.word() : corpus.word(1000 + topic * kTopicWords + corpus.rank() % kTopicWords);
+        }
+        return s;
+    };
+    vector<string> sources; // contents of some docs, to draw queries from
+    for (size_t i = 0; i < docs; ++i) {
+        int topic = corpus.below(kTopics);
+        string title = topicText(topic, 2 + corpus.below(6));
+        string content = topicText(topic, 30 + corpus.below(300));
+        if (sources.size() < queries * 2 && corpus.below(docs / (queries * 2) + 1) == 0) sources.push_back(content);
+        engine.addDoc((int)i, title, content, "bench:" + to_string(i));
+        if ((i + 1) % 100000 == 0) engine.refresh();
+    }
+    engine.refresh();
+    auto t0 = chrono::steady_clock::now();
+    engine.setDenseProbes(1);
+    double buildSecs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    auto snap = engine.snapshot();
+    auto st = snap->indexStats();
+    uint32_t lists = 0;
+    for (auto &seg : snap->segs) lists = max(lists, seg->dense.lists());
+    cout << fixed << setprecision(1);
+    cout << "Embedded " << docs << " docs in " << st.segments << " segments in " << buildSecs << " s: "
+         << kDenseDim << " dims, " << st.denseBytes / 1e6 << " MB, up to " << lists << " lists per segment\n";
+
+    vector<string> qs;
+    vector<vector<int>> exact;
+    double exactUs = 0;
+    for (size_t k = 0; qs.size() < queries && k < sources.size() * 4; ++k) {
+        vector<string> words = tokenize(sources[k % sources.size()]);
+        string q;
+        for (int w = 6 + corpus.below(6); w > 0; --w) q += (q.empty() ? "" : " ") + words[corpus.below(words.size())];
+        auto s0 = chrono::steady_clock::now();
+        auto qvec = snap->queryVector(snap->parseQuery(q).qids);
+        TopK top(10);
+        for (auto &seg : snap->segs) {
+            for (uint32_t i = 0; i < seg->size(); ++i) {
+                if (seg->isDeleted(i)) continue;
+                double sim = snap->cosineSimilarity(*seg, i, seg->docs[i], qvec);
+                if (sim > 0) top.push(seg->docs.id(i), sim);
+            }
+        }
+        exactUs += chrono::duration<double, micro>(chrono::steady_clock::now() - s0).count();
+        vector<int> ids;
+        for (auto &e : top.sorted()) ids.push_back(e.first);
+        if (ids.empty()) continue;
+        qs.push_back(q);
+        exact.push_back(ids);
+    }
+    if (qs.empty()) return;
+    cout << left << setw(8) << "probes" << right << setw(10) << "p50 us" << setw(10) << "p99 us" << setw(10) << "mean us"
+         << setw(12) << "recall@10" << setw(12) << "ivf recall" << "\n";
+    cout << left << setw(8) << "exact" << right << setw(10) << "-" << setw(10) << "-" << setw(10) << exactUs / qs.size()
+         << setw(12) << "1.000" << setw(12) << "-" << "\n";
+    vector<vector<pair<int,double>>> full;
+    for (auto &q : qs) full.push_back(snap->denseSearch(q, 10, lists));
+    auto overlap = [](const vector<int> &want, const vector<pair<int,double>> &got) {
+        size_t n = 0;
+        for (int id : want) for (auto &g : got) if (g.first == id) { n++; break; }
+        return n;
+    };
+    for (uint32_t probes = 1; ; probes = min(probes * 2, lists)) {
+        vector<double> us;
+        size_t found = 0, total = 0, ivfFound = 0, ivfTotal = 0;
+        for (size_t k = 0; k < qs.size(); ++k) {
+            auto s0 = chrono::steady_clock::now();
+            auto got = snap->denseSearch(qs[k], 10, probes);
+            us.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - s0).count());
+            found += overlap(exact[k], got);
+            total += exact[k].size();
+            vector<int> ids;
+            for (auto &e : full[k]) ids.push_back(e.first);
+            ivfFound += overlap(ids, got);
+            ivfTotal += ids.size();
+        }
+        sort(us.begin(), us.end());
+        cout << left << setw(8) << probes << right << setw(10) << us[us.size() / 2] << setw(10) << us[min(us.size() - 1, us.size() * 99 / 100)]
+             << setw(10) << accumulate(us.begin(), us.end(), 0.0) / us.size() << setprecision(3) << setw(12)
+             << (double)found / total << setw(12) << (ivfTotal ? (double)ivfFound / ivfTotal : 1.0) << setprecision(1) << "\n";
+        if (probes >= lists) break;
+    }
+}
+
 // -------------------- Demo main --------------------
-int main() {
+HttpServer *activeServer = nullptr; // stopped by SIGINT/SIGTERM in --serve mode
+
+void printCacheStats(const SearchEngine &engine) {
+    auto st = engine.cacheStats();
+    auto line = [](const char *name, const CacheStats &s) {
+        uint64_t lookups = s.hits + s.misses;
+        cout << name << ": " << s.hits << "/" << lookups << " hits (" << fixed << setprecision(1)
+             << (lookups ? 100.0 * s.hits / lookups : 0.0) << "%), " << s.entries << " entries, "
+             << s.bytes << "/" << s.budget << " bytes, " << s.evictions << " evicted, " << s.rejected << " not admitted\n";
+    };
+    line("Result cache", st.first);
+    line("Phrase cache", st.second);
+    line("Plan cache", engine.planCacheStats());
+}
+
+void printProfile(const QueryProfile &p) {
+    if (!SEARCH_PROFILE) { cout << "Profiling is compiled out (SEARCH_PROFILE=0).\n"; return; }
+    cout << fixed << setprecision(1);
+    for (int s = 0; s < QueryProfile::STAGES; ++s) {
+        if (p.ns[s]) cout << "  " << left << setw(11) << QueryProfile::stageNames[s] << right << setw(10) << p.ns[s] / 1e3 << " us\n";
+    }
+    cout << "  " << left << setw(11) << "total" << right << setw(10) << p.totalNs / 1e3 << " us\n";
+    cout << "  " << p.candidates << " candidates scored, " << p.postings << " postings and " << p.positions
+         << " positions decoded (" << p.bytes << " bytes), " << p.levenshtein << " Levenshtein rows\n";
+}
+
+int main(int argc, char **argv) {
     ios::sync_with_stdio(false);
     cin.tie(nullptr);
 
+    // --index FILE: open the segment if it exists, else build the index and save it there
+    // --load FILE [--tsv] [--budget MB]: index a JSONL (or TSV) corpus instead of the sample docs
+    // --bench-tokenizer FILE: measure tokenizer throughput and exit
+    // --queries FILE: run one query per line on the query pool, print the top 10 of each and exit
+    // --metrics: after --queries, also print the query metrics in the Prometheus text format
+    // --serve PORT: answer GET /search?q=...&offset=N&limit=N and GET /metrics on 127.0.0.1:PORT
+    // --threads N: threads for indexing and for the query pool
+    // --shards N: split each query into N doc-range shards scored in parallel
+    // --cache MB: result cache budget, phrase cache twice that, plan cache a quarter (0: no caching)
+    // --ranker classic|bm25: scoring model
+    // --bench DOCS [--bench-queries N]: index a synthetic corpus of DOCS docs, time N queries of each kind and exit
+    // --dense PROBES: answer long queries by dense retrieval, probing PROBES lists per segment
+    // --bench-dense DOCS [--bench-queries N]: dense retrieval recall and latency against exact cosine (N <= 200), then exit
+    string indexPath, loadPath, queriesPath;
+    int threads = 0, shards = 1, cacheMb = -1, servePort = -1;
+    bool printMetrics = false;
+    Ranker ranker = Ranker::Classic;
+    size_t benchDocs = 0, benchQueries = 1000, benchDenseDocs = 0;
+    int denseProbes = 0;
+    LoadOptions loadOpt;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a == "--index" && i + 1 < argc) indexPath = argv[++i];
+        else if (a == "--load" && i + 1 < argc) loadPath = argv[++i];
+        else if (a == "--budget" && i + 1 < argc) loadOpt.memoryBudget = (size_t)atol(argv[++i]) << 20;
+        else if (a == "--tsv") loadOpt.tsv = true;
+        else if (a == "--queries" && i + 1 < argc) queriesPath = argv[++i];
+        else if (a == "--metrics") printMetrics = true;
+        else if (a == "--serve" && i + 1 < argc) servePort = atoi(argv[++i]);
+        else if (a == "--threads" && i + 1 < argc) threads = atoi(argv[++i]);
+        else if (a == "--shards" && i + 1 < argc) shards = atoi(argv[++i]);
+        else if (a == "--cache" && i + 1 < argc) cacheMb = max(0, atoi(argv[++i]));
+        else if (a == "--ranker" && i + 1 < argc) ranker = string(argv[++i]) == "bm25" ? Ranker::Bm25f : Ranker::Classic;
+        else if (a == "--bench" && i + 1 < argc) benchDocs = atol(argv[++i]);
+        else if (a == "--bench-queries" && i + 1 < argc) benchQueries = max(1L, atol(argv[++i]));
+        else if (a == "--dense" && i + 1 < argc) denseProbes = max(0, atoi(argv[++i]));
+        else if (a == "--bench-dense" && i + 1 < argc) benchDenseDocs = atol(argv[++i]);
+        else if (a == "--bench-tokenizer" && i + 1 < argc) { benchTokenizer(argv[++i]); return 0; }
+    }
+
     SearchEngine engine;
-    // Add sample docs (you can add many more or load from files)
-    engine.addDoc(1, "C++ Basics", "Learn C++ programming from scratch. This tutorial covers variables, loops, functions, classes, and more to help you get started quickly. Great for beginners.", "https://example.com/cpp-basics");
-    engine.addDoc(2, "Qt Tutorial", "GUI development with Qt framework. Create windows, buttons, input forms, layouts, and handle events in C++ using Qt.", "https://example.com/qt-tutorial");
-    engine.addDoc(3, "Advanced Search", "Building search engines in C++ using data structures like vectors, maps, and sets. Learn inverted index, keyword search, ranking, and tf-idf.", "https://example.com/advanced-search");
-    engine.addDoc(4, "Data Structures", "Learn arrays, linked list, stack, queue, trees, and graphs in C++. Understand their implementation and use in algorithms.", "https://example.com/ds");
-    engine.addDoc(5, "Algorithms", "Sorting, searching, graph traversal, dynamic programming, and more. Master algorithmic problem-solving with C++ examples.", "https://example.com/algo");
-    engine.addDoc(6, "DS & Algo (Short: DSA)", "Complete notes and examples for Data Structures and Algorithms (DSA). Perfect for placement and coding interviews.", "https://example.com/dsa");
-    engine.addDoc(7, "Binary Tree Top View", "This article explains top view of binary tree and other tree traversals including level-order and inorder, with examples in C++.", "https://example.com/topview");
-    engine.buildIndex();
+    if (threads > 0) engine.setThreads(threads);
+    if (shards > 1) engine.setQueryShards(shards);
+    if (ranker != Ranker::Classic) engine.setRanker(ranker);
+    if (cacheMb >= 0) engine.setCacheBudget((size_t)cacheMb << 20, (size_t)cacheMb << 21, (size_t)cacheMb << 18);
+    if (benchDenseDocs) {
+        benchDense(engine, benchDenseDocs, min<size_t>(benchQueries, 200));
+        return 0;
+    }
+    if (denseProbes) engine.setDenseProbes(denseProbes);
+    if (benchDocs) {
+        if (cacheMb < 0) engine.setCacheBudget(0, 0, 4 << 20); // time the engine, not the result caches; plans are timed both ways
+        benchEngine(engine, benchDocs, benchQueries);
+        return 0;
+    }
+    string err;
+    if (!indexPath.empty() && access(indexPath.c_str(), F_OK) == 0 && engine.open(indexPath, err)) {
+        cout << "Opened index " << indexPath << "\n";
+    } else if (!loadPath.empty()) {
+        LoadStats ls;
+        if (!indexPath.empty()) loadOpt.segmentPrefix = indexPath;
+        if (!loadCorpus(engine, loadPath, loadOpt, ls, err)) { cout << "Load failed: " << err << "\n"; return 1; }
+        if (!indexPath.empty() && !engine.save(indexPath, err)) cout << "Cannot save index: " << err << "\n";
+    } else {
+        if (!err.empty()) cout << "Cannot open index (" << err << "), rebuilding.\n";
+        // Add sample docs (you can add many more or load from files)
+        engine.addDoc(1, "C++ Basics", "Learn C++ programming from scratch. This tutorial covers variables, loops, functions, classes, and more to help you get started quickly. Great for beginners.", "https://example.com/cpp-basics");
+        engine.addDoc(2, "Qt Tutorial", "GUI development with Qt framework. Create windows, buttons, input forms, layouts, and handle events in C++ using Qt.", "https://example.com/qt-tutorial");
+        engine.addDoc(3, "Advanced Search", "Building search engines in C++ using data structures like vectors, maps, and sets. Learn inverted index, keyword search, ranking, and tf-idf.", "https://example.com/advanced-search");
+        engine.addDoc(4, "Data Structures", "Learn arrays, linked list, stack, queue, trees, and graphs in C++. Understand their implementation and use in algorithms.", "https://example.com/ds");
+        engine.addDoc(5, "Algorithms", "Sorting, searching, graph traversal, dynamic programming, and more. Master algorithmic problem-solving with C++ examples.", "https://example.com/algo");
+        engine.addDoc(6, "DS & Algo (Short: DSA)", "Complete notes and examples for Data Structures and Algorithms (DSA). Perfect for placement and coding interviews.", "https://example.com/dsa");
+        engine.addDoc(7, "Binary Tree Top View", "This article explains top view of binary tree and other tree traversals including level-order and inorder, with examples in C++.", "https://example.com/topview");
+        engine.buildIndex();
+        if (!indexPath.empty()) {
+            if (engine.save(indexPath, err)) cout << "Saved index to " << indexPath << "\n";
+            else cout << "Cannot save index: " << err << "\n";
+        }
+    }
+    auto stats = engine.indexStats();
+    cout << "Index: " << stats.terms << " terms, " << stats.postings << " postings, " << stats.bytes << " bytes ("
+         << fixed << setprecision(2) << (stats.postings ? (double)stats.bytes / stats.postings : 0.0) << " bytes/posting), "
+         << "positions " << stats.posBytes << " bytes, dictionary " << stats.dictBytes << " bytes\n";
+
+    if (servePort >= 0) {
+        HttpServer server(engine, threads > 0 ? threads : max(1u, thread::hardware_concurrency()));
+        if (!server.start(servePort, err)) { cout << "Cannot serve: " << err << "\n"; return 1; }
+        cout << "Serving on http://127.0.0.1:" << server.port() << " (GET /search?q=...&offset=0&limit=10, GET /metrics)\n" << flush;
+        activeServer = &server;
+        signal(SIGINT, [](int) { activeServer->stop(); });
+        signal(SIGTERM, [](int) { activeServer->stop(); });
+        server.run();
+        activeServer = nullptr;
+        cout << "Stopped.\n";
+        return 0;
+    }
+
+    if (!queriesPath.empty()) {
+        ifstream in(queriesPath);
+        vector<string> queries;
+        for (string q; getline(in, q); ) if (!q.empty()) queries.push_back(q);
+        QueryPool qp(engine, threads > 0 ? threads : max(1u, thread::hardware_concurrency()));
+        auto start = chrono::steady_clock::now();
+        auto results = qp.searchAll(queries);
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        for (size_t i = 0; i < queries.size(); ++i) {
+            cout << queries[i] << "\t";
+            for (auto &r : results[i]) cout << " " << r.first << ":" << setprecision(3) << r.second;
+            cout << "\n";
+        }
+        cout << queries.size() << " queries in " << setprecision(1) << secs * 1000 << " ms ("
+             << setprecision(0) << (secs > 0 ? queries.size() / secs : 0.0) << " queries/s)\n";
+        printCacheStats(engine);
+        if (printMetrics) cout << engine.metricsText();
+        return 0;
+    }
 
     cout << "Mini Full-Text Search Engine (local)\n";
-    cout << "Commands: type a query and press enter. For phrase search, use double quotes: \"top view\".\n";
-    cout << "Type ':quit' to exit, ':open <ID>' to open a doc, ':page <n>' to change results per page.\n";
+    cout << "Commands: type a query and press enter. For phrase search, use double quotes: \"top view\" (\"top view\"~2 allows gaps).\n";
+    cout << "Type ':quit' to exit, ':open <ID>' to open a doc, ':page <n>' to change results per page, ':stats' for cache stats.\n";
+    cout << "':explain <query>' shows where the time of a query goes, ':metrics' dumps the query metrics.\n";
+    cout << "Prefix search: algo* matches every term starting with algo; ':complete <prefix>' lists completions.\n";
+    cout << "Boolean search: AND, OR, NOT and parentheses, title:word or title:\"a phrase\" for titles only, e.g. (tree OR graph) AND NOT title:binary\n";
 
     int pageSize = 3;
+    bool bold = isatty(STDOUT_FILENO); // how snippets mark the query terms
     while (true) {
         cout << "\nEnter search (or command): ";
         string line;
@@ -377,7 +5716,7 @@ int main() {
             stringstream ss(line);
             string cmd; int id;
             ss >> cmd >> id;
-            const Doc* d = engine.getDocById(id);
+            auto d = engine.getDocById(id);
             if (d) engine.printDocFull(*d);
             else cout << "Doc not found.\n";
             continue;
@@ -386,6 +5725,24 @@ int main() {
             string cmd; ss >> cmd >> pageSize;
             cout << "Page size set to " << pageSize << "\n";
             continue;
+        } else if (line.rfind(":complete", 0) == 0) {
+            stringstream ss(line);
+            string cmd, prefix;
+            ss >> cmd >> prefix;
+            for (auto &t : engine.complete(toLower(prefix))) cout << t.first << " (" << t.second << " docs)\n";
+            continue;
+        } else if (line == ":stats") {
+            printCacheStats(engine);
+            continue;
+        } else if (line.rfind(":explain ", 0) == 0) {
+            QueryProfile p;
+            auto results = engine.explain(line.substr(9), 50, p);
+            cout << results.size() << " results\n";
+            printProfile(p);
+            continue;
+        } else if (line == ":metrics") {
+            cout << engine.metricsText();
+            continue;
         }
 
         auto start = chrono::high_resolution_clock::now();
@@ -405,16 +5762,17 @@ int main() {
             int startIdx = page * pageSize;
             int endIdx = min(startIdx + pageSize, (int)results.size());
             cout << "\n--- Page " << page+1 << " / " << totalPages << " ---\n";
+            vector<int> pageIds;
+            for (int i = startIdx; i < endIdx; ++i) pageIds.push_back(results[i].first);
+            vector<Snippet> snips = engine.snippets(line, pageIds);
             for (int i = startIdx; i < endIdx; ++i) {
                 int id = results[i].first;
                 double score = results[i].second;
-                const Doc* d = engine.getDocById(id);
+                auto d = engine.getDocById(id);
                 if (!d) continue;
                 cout << "[" << id << "] (score: " << fixed << setprecision(3) << score << ") ";
                 cout << d->title << "  - " << d->link << "\n";
-                string snippet = d->content.substr(0,140);
-                if (d->content.size() > 140) snippet += "...";
-                cout << "   " << snippet << "\n";
+                cout << "   " << snips[i - startIdx].render(bold ? "\033[1m" : "[", bold ? "\033[0m" : "]") << "\n";
             }
             cout << "Options: [N]ext | [P]rev | [O]pen <id> | [Q]uit results\n";
             string opt;
@@ -427,7 +5785,7 @@ int main() {
             } else if (opt.rfind("O",0) == 0 || opt.rfind("o",0) == 0) {
                 stringstream ss(opt);
                 string c; int id; ss >> c >> id;
-                const Doc* d = engine.getDocById(id);
+                auto d = engine.getDocById(id);
                 if (d) engine.printDocFull(*d);
                 else cout << "Invalid id.\n";
             } else {
@@ -2,29 +2,29 @@
 using namespace std;
 #include <chrono>
 
-// WebPage class
+// WebPage class: read-only view of a page's fields
 class WebPage {
 private:
     int id;
-    string title;
-    string content;
-    string link;
+    string_view title;
+    string_view content;
+    string_view link;
 
 public:
-    WebPage(int _id, const string &_title, const string &_content, const string &_link)
+    WebPage(int _id, string_view _title, string_view _content, string_view _link)
         : id(_id), title(_title), content(_content), link(_link) {}
 
     int getId() const { return id; }
-    string getTitle() const { return title; }
-    string getContent() const { return content; }
-    string getLink() const { return link; }
+    string_view getTitle() const { return title; }
+    string_view getContent() const { return content; }
+    string_view getLink() const { return link; }
 
     void displaySummary() const {
         cout << "ID: " << id
              << " | Title: " << title
              << " | Link: " << link
              << "\nDescription: " 
-             << (content.length() > 150 ? content.substr(0,150) + "..." : content)
+             << content.substr(0,150) << (content.length() > 150 ? "..." : "")
              << "\n\n";
     }
 
@@ -35,80 +35,194 @@ public:
     }
 };
 
-// Node for linked list
-struct Node {
-    WebPage page;
-    Node* next;
-    Node(const WebPage &p) : page(p), next(nullptr) {}
-};
+// Byte-oriented LZ77 in the style of LZ4. Each sequence is a token byte
+// (literal count and match length - 4 in 4 bits each, 15 = length bytes
+// follow), the literals, then a 2-byte offset back into the output and the
+// extra match length. The last sequence has literals only.
+const int kMinMatch = 4;
+
+string lzCompress(string_view in) {
+    string out;
+    vector<int> table(1 << 12, -1); // hash of 4 bytes -> last position
+    auto hash = [&](size_t i) { uint32_t v; memcpy(&v, in.data() + i, 4); return (v * 2654435761u) >> 20; };
+    auto putLen = [&](size_t n) {
+        for (; n >= 255; n -= 255) out.push_back((char)255);
+        out.push_back((char)n);
+    };
+    auto emit = [&](size_t from, size_t lits, size_t offset, size_t len) {
+        size_t m = len ? len - kMinMatch : 0;
+        out.push_back((char)((min<size_t>(lits, 15) << 4) | min<size_t>(m, 15)));
+        if (lits >= 15) putLen(lits - 15);
+        out.append(in.data() + from, lits);
+        if (!len) return;
+        out.push_back((char)(offset & 0xff));
+        out.push_back((char)(offset >> 8));
+        if (m >= 15) putLen(m - 15);
+    };
+    size_t anchor = 0, i = 0;
+    while (i + kMinMatch <= in.size()) {
+        uint32_t h = hash(i);
+        int cand = table[h];
+        table[h] = i;
+        if (cand < 0 || i - cand > 65535 || memcmp(in.data() + cand, in.data() + i, kMinMatch) != 0) { i++; continue; }
+        size_t len = kMinMatch;
+        while (i + len < in.size() && in[cand + len] == in[i + len]) len++;
+        emit(anchor, i - anchor, i - cand, len);
+        i += len;
+        anchor = i;
+    }
+    emit(anchor, in.size() - anchor, 0, 0);
+    return out;
+}
 
-// Linked List class to store database
-class LinkedList {
+string lzDecompress(string_view in) {
+    string out;
+    const unsigned char *p = (const unsigned char*)in.data(), *end = p + in.size();
+    auto getLen = [&](size_t n) {
+        if (n == 15) {
+            unsigned char b;
+            do { b = *p++; n += b; } while (b == 255);
+        }
+        return n;
+    };
+    while (p < end) {
+        unsigned char token = *p++;
+        size_t lits = getLen(token >> 4);
+        out.append((const char*)p, lits);
+        p += lits;
+        if (p >= end) break;
+        size_t offset = p[0] | (p[1] << 8);
+        p += 2;
+        size_t len = getLen(token & 15) + kMinMatch;
+        for (size_t from = out.size() - offset; len--; ) out.push_back(out[from++]); // may overlap
+    }
+    return out;
+}
+
+// Page store: the fields of all pages live in one arena and are located by
+// offsets, so reading a page costs no allocation. Contents can optionally be
+// packed into compressed blocks of about kBlockBytes, which are unpacked one
+// at a time into a cache; see page() for how long a page read then lasts.
+class PageStore {
 private:
-    Node* head;
-    Node* tail;
-    int size;
+    static const uint32_t NONE = UINT32_MAX;
+    static const size_t kBlockBytes = 16 << 10;
+
+    struct Entry {
+        int id;
+        size_t title;                // offset of title + link in the arena
+        uint32_t titleLen, linkLen;
+        uint32_t block;              // content block, NONE if the content is in the arena
+        size_t content;              // offset in the arena or in the raw block
+        uint32_t contentLen;
+    };
+
+    bool compress;
+    string arena;
+    vector<Entry> entries;
+    unordered_map<int, uint32_t> byId; // page id -> entry
+    vector<string> blocks;             // sealed, compressed
+    string open;                       // block being filled, raw
+    mutable string cache;              // last block read, raw
+    mutable uint32_t cached = NONE;
+
+    string_view contentOf(const Entry &e) const {
+        if (e.block == NONE) return string_view(arena).substr(e.content, e.contentLen);
+        if (e.block == blocks.size()) return string_view(open).substr(e.content, e.contentLen);
+        if (cached != e.block) {
+            cache = lzDecompress(blocks[e.block]);
+            cached = e.block;
+        }
+        return string_view(cache).substr(e.content, e.contentLen);
+    }
 
 public:
-    LinkedList() : head(nullptr), tail(nullptr), size(0) {}
+    PageStore(bool compressContent = false) : compress(compressContent) {}
 
     void addPage(const WebPage &page) {
-        Node* node = new Node(page);
-        if (!head) head = tail = node;
-        else {
-            tail->next = node;
-            tail = node;
+        Entry e;
+        e.id = page.getId();
+        e.title = arena.size();
+        e.titleLen = page.getTitle().size();
+        e.linkLen = page.getLink().size();
+        arena.append(page.getTitle());
+        arena.append(page.getLink());
+        e.contentLen = page.getContent().size();
+        if (compress) {
+            e.block = blocks.size();
+            e.content = open.size();
+            open.append(page.getContent());
+            if (open.size() >= kBlockBytes) {
+                blocks.push_back(lzCompress(open));
+                open.clear();
+            }
+        } else {
+            e.block = NONE;
+            e.content = arena.size();
+            arena.append(page.getContent());
         }
-        size++;
+        byId.emplace(e.id, entries.size()); // findById keeps returning the first page with an id
+        entries.push_back(e);
     }
 
-    Node* getHead() const { return head; }
-    int getSize() const { return size; }
+    size_t getSize() const { return entries.size(); }
 
-    WebPage* findById(int id) const {
-        Node* curr = head;
-        while (curr) {
-            if (curr->page.getId() == id) return &curr->page;
-            curr = curr->next;
-        }
-        return nullptr;
+    // The fields of page i, as views into the store. Without compression
+    // they last until the next addPage(). With it, the content is a view
+    // into the block last read or filled, so it also lasts only until the
+    // next page() or findById(): copy it to keep it longer.
+    WebPage page(size_t i) const {
+        const Entry &e = entries[i];
+        string_view a(arena);
+        return WebPage(e.id, a.substr(e.title, e.titleLen), contentOf(e), a.substr(e.title + e.titleLen, e.linkLen));
     }
 
-    vector<WebPage*> getAllPages() const {
-        vector<WebPage*> pages;
-        Node* curr = head;
-        while (curr) {
-            pages.push_back(&curr->page);
-            curr = curr->next;
-        }
-        return pages;
+    // the first page added with this id; it lasts as long as page() says
+    optional<WebPage> findById(int id) const {
+        auto it = byId.find(id);
+        if (it == byId.end()) return nullopt;
+        return page(it->second);
+    }
+
+    // bytes held for the stored fields
+    size_t byteSize() const {
+        size_t n = arena.size() + open.size() + entries.size() * sizeof(Entry);
+        for (auto &b : blocks) n += b.size();
+        return n;
     }
 };
 
 // Search Engine class
 class SearchEngine {
 private:
-    LinkedList database;
+    const PageStore &database;
     unordered_map<string, set<int>> invertedIndex;
 
-    string toLower(const string& str) {
-        string res = str;
+    string toLower(string_view str) {
+        string res(str);
         transform(res.begin(), res.end(), res.begin(), ::tolower);
         return res;
     }
 
+    // index the whitespace-separated words of text under id
+    void indexWords(string_view text, int id) {
+        size_t i = 0;
+        while (i < text.size()) {
+            while (i < text.size() && isspace((unsigned char)text[i])) i++;
+            size_t start = i;
+            while (i < text.size() && !isspace((unsigned char)text[i])) i++;
+            if (i > start) invertedIndex[toLower(text.substr(start, i - start))].insert(id);
+        }
+    }
+
 public:
-    SearchEngine(const LinkedList &db) : database(db) {}
+    SearchEngine(const PageStore &db) : database(db) {}
 
     void buildIndex() {
-        Node* curr = database.getHead();
-        while (curr) {
-            stringstream ss(curr->page.getTitle() + " " + curr->page.getContent());
-            string word;
-            while (ss >> word) {
-                invertedIndex[toLower(word)].insert(curr->page.getId());
-            }
-            curr = curr->next;
+        for (size_t i = 0; i < database.getSize(); ++i) {
+            WebPage p = database.page(i);
+            indexWords(p.getTitle(), p.getId());
+            indexWords(p.getContent(), p.getId());
         }
     }
 
@@ -135,8 +249,7 @@ public:
             int end = min(start + pageSize, (int)results.size());
 
             for (int i = start; i < end; i++) {
-                WebPage* p = database.findById(results[i]);
-                if (p) p->displaySummary();
+                if (auto p = database.findById(results[i])) p->displaySummary();
             }
 
             cout << "Options: [N]ext page | [P]revious page | [O]pen <ID> | [Q]uit\n";
@@ -152,8 +265,7 @@ public:
             } else if (choice == "O" || choice == "o") {
                 int id;
                 cin >> id;
-                WebPage* p = database.findById(id);
-                if (p) p->displayFull();
+                if (auto p = database.findById(id)) p->displayFull();
             } else if (choice == "Q" || choice == "q") break;
             else cout << "Invalid option! Try again.\n";
         }
@@ -161,12 +273,23 @@ public:
 };
 
 int main() {
-    LinkedList pages;
-    pages.addPage(WebPage(1, "C++ Basics", "Learn C++ programming from scratch. This tutorial covers variables, loops, functions, classes, and more to help you get started quickly.", "https://example.com/cpp-basics"));
-    pages.addPage(WebPage(2, "Qt Tutorial", "GUI development with Qt framework. Create windows, buttons, input forms, layouts, and handle events in C++ using Qt.", "https://example.com/qt-tutorial"));
-    pages.addPage(WebPage(3, "Advanced Search", "Building search engines in C++ using data structures like vectors, maps, and sets. Learn inverted index, keyword search, and ranking.", "https://example.com/advanced-search"));
-    pages.addPage(WebPage(4, "Data Structures", "Learn arrays, linked list, stack, queue, trees, and graphs in C++. Understand their implementation and use in algorithms.", "https://example.com/ds"));
-    pages.addPage(WebPage(5, "Algorithms", "Sorting, searching, graph traversal, dynamic programming, and more. Master algorithmic problem-solving with C++ examples.", "https://example.com/algo"));
+    vector<WebPage> samples = {
+        WebPage(1, "C++ Basics", "Learn C++ programming from scratch. This tutorial covers variables, loops, functions, classes, and more to help you get started quickly.", "https://example.com/cpp-basics"),
+        WebPage(2, "Qt Tutorial", "GUI development with Qt framework. Create windows, buttons, input forms, layouts, and handle events in C++ using Qt.", "https://example.com/qt-tutorial"),
+        WebPage(3, "Advanced Search", "Building search engines in C++ using data structures like vectors, maps, and sets. Learn inverted index, keyword search, and ranking.", "https://example.com/advanced-search"),
+        WebPage(4, "Data Structures", "Learn arrays, linked list, stack, queue, trees, and graphs in C++. Understand their implementation and use in algorithms.", "https://example.com/ds"),
+        WebPage(5, "Algorithms", "Sorting, searching, graph traversal, dynamic programming, and more. Master algorithmic problem-solving with C++ examples.", "https://example.com/algo"),
+    };
+
+    // contents are kept compressed, so the codec must give every one back
+    PageStore pages(true);
+    for (const WebPage &p : samples) {
+        if (lzDecompress(lzCompress(p.getContent())) != p.getContent()) {
+            cerr << "Compression does not round-trip page " << p.getId() << "\n";
+            return 1;
+        }
+        pages.addPage(p);
+    }
 
     SearchEngine engine(pages);
     engine.buildIndex();